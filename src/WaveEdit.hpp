@@ -11,6 +11,8 @@
 #include <thread>
 #include <vector>
 #include <complex>
+#include <functional>
+#include <memory>
 
 
 #define STRINGIFY(x) #x
@@ -41,6 +43,16 @@ inline int clampi(int x, int min, int max) {
 	return x > max ? max : x < min ? min : x;
 }
 
+/** Scrambles the bits of x, for noise which is a pure function of its index */
+inline uint32_t hashu(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
 // Floats
 
 inline float eucmodf(float a, float base){
@@ -88,6 +100,12 @@ inline float randf() {
 	return (float)rand() / RAND_MAX;
 }
 
+/** Returns triangular noise on (-1, 1) for the index n, the difference of two uniform variables */
+inline float tpdff(uint32_t n) {
+	uint32_t h = hashu(n);
+	return ((int32_t) (h & 0xffff) - (int32_t) (h >> 16)) * (1.f / 65536.f);
+}
+
 /** Complex multiply c = a * b
 It is of course acceptable to reuse arguments
 i.e. cmultf(&ar, &ai, ar, ai, br, bi)
@@ -99,11 +117,118 @@ inline void cmultf(float *cr, float *ci, float ar, float ai, float br, float bi)
 
 void RFFT(const float *in, float *out, int len);
 void IRFFT(const float *in, float *out, int len);
+/** Like RFFT() but for any length, using cached plans (Bluestein's algorithm for lengths pffft can't handle).
+Writes len / 2 + 1 interleaved complex bins to `out`, without packing the Nyquist bin into out[1].
+*/
+void RDFT(const float *in, float *out, int len);
+/** Inverse of RDFT(), reading len / 2 + 1 interleaved complex bins */
+void IRDFT(const float *in, float *out, int len);
+
+struct DFTPlan;
+
+/** Converts one period of a periodic signal between two lengths by truncating or zero-padding its spectrum.
+Used to oversample waves for display and to load single cycles of other lengths.
+The transforms are planned on construction, and process() only works in the caller's buffer.
+*/
+struct CyclicResampler {
+	int inLen;
+	int outLen;
+	std::shared_ptr<const DFTPlan> inPlan;
+	std::shared_ptr<const DFTPlan> outPlan;
+
+	CyclicResampler(int inLen, int outLen);
+	/** Number of floats process() needs in `buffer` */
+	int bufferLen() const;
+	void process(const float *in, float *out, float *buffer) const;
+};
+
+/** One-off CyclicResampler::process() */
+void cyclicResample(const float *in, int inLen, float *out, int outLen);
+/** Returns exp(2 pi i m / WAVE_LEN) for 0 <= m < WAVE_LEN as interleaved complex numbers.
+Rotations by whole harmonics of a wave are lookups into this table.
+*/
+const float *wavePhasors();
+/** Writes the `len` interleaved complex numbers exp(2 pi i (phase + step k)) with a complex recurrence, instead of a sin and cos per element */
+void phasorRamp(float *out, double phase, double step, int len);
+
+enum ResampleQuality {
+	/** Short kernels, fast enough to run every frame while dragging */
+	RESAMPLE_DRAFT,
+	RESAMPLE_HIGH,
+	RESAMPLE_QUALITIES_LEN
+};
+
+/** Resamples `in` by `ratio` (output rate / input rate) with a polyphase windowed sinc filter.
+Filters are cached per thread and quality, so calling repeatedly with the same ratio only filters.
+Returns the number of samples written.
+*/
+int resample(const float *in, int inLen, float *out, int outLen, double ratio, ResampleQuality quality = RESAMPLE_HIGH);
+
+enum Dither {
+	DITHER_NONE,
+	DITHER_TPDF,
+	DITHER_SHAPED,
+	DITHER_LEN
+};
+
+extern const char *ditherNames[DITHER_LEN];
+/** Dither chosen in the menu for exporting 16 bit WAVs. Saves take it as a parameter, since they run on the I/O thread. */
+extern Dither exportDither;
 
-int resample(const float *in, int inLen, float *out, int outLen, double ratio);
-void cyclicOversample(const float *in, float *out, int len, int oversample);
 void i16_to_f32(const int16_t *in, float *out, int length);
-void f32_to_i16(const float *in, int16_t *out, int length);
+/** Rounds to 16 bit, with optional dither of +-1 LSB.
+The noise of sample i depends only on seed + i, so pass different seeds for signals which shouldn't share a noise pattern.
+DITHER_SHAPED feeds back the quantization error to move it toward the Nyquist frequency, so it can't be vectorized.
+*/
+void f32_to_i16(const float *in, int16_t *out, int length, Dither dither = DITHER_NONE, uint32_t seed = 0);
+
+
+////////////////////
+// simd.cpp
+////////////////////
+
+enum SIMDLevel {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_AVX512,
+	SIMD_NEON,
+	SIMD_LEVELS_LEN
+};
+
+extern const char *simdLevelNames[SIMD_LEVELS_LEN];
+
+/** The hot DSP loops, compiled once per instruction set.
+Call through the `dsp` table, which simdInit() points to the best set for this CPU.
+*/
+struct DSPKernels {
+	/** x[i] *= a */
+	void (*scale)(float *x, float a, int len);
+	/** Multiplies `len` interleaved complex numbers, x[k] *= y[k] */
+	void (*cmult)(float *x, const float *y, int len);
+	/** y[k] = 2 |x[k]| for `len` interleaved complex numbers */
+	void (*norm)(const float *x, float *y, int len);
+	/** Finds the range of a x[i] + b i + c */
+	void (*rampMinMax)(const float *x, float a, float b, float c, int len, float *min, float *max);
+	/** y[i] = clampf(a x[i] + b i + c, min, max) */
+	void (*rampClamp)(const float *x, float *y, float a, float b, float c, float min, float max, int len);
+	/** x[i] = sin(n asin(x[i])), or sin(n asin(1 / x[i])) outside [-1, 1] */
+	void (*chebyshev)(float *x, float n, int len);
+	/** Returns sum x[i] y[i] */
+	float (*dot)(const float *x, const float *y, int len);
+	/** y[i] = x[i] / 32767 */
+	void (*i16ToF32)(const int16_t *x, float *y, int len);
+	/** y[i] = round(clampf(x[i] * 32767 + dither * tpdff(seed + i), -32767, 32767)) */
+	void (*f32ToI16)(const float *x, int16_t *y, int len, float dither, uint32_t seed);
+};
+
+extern DSPKernels dsp;
+
+/** Selects the widest instruction set supported by the CPU, unless the OXIWAVE_SIMD environment variable names one */
+void simdInit();
+/** Returns false if `level` isn't supported by this CPU or build */
+bool simdSetLevel(SIMDLevel level);
+SIMDLevel simdGetLevel();
 
 
 ////////////////////
@@ -121,6 +246,17 @@ void ellipsize(char *str, int maxLen);
 unsigned char *base64_encode(const unsigned char *src, size_t len, size_t *out_len);
 unsigned char *base64_decode(const unsigned char *src, size_t len, size_t *out_len);
 bool str_ends_with(char *str, const char *ending);
+/** FNV-1a hash of a byte string. Pass the previous result as `h` to continue hashing across several buffers. */
+uint32_t fnv1a(const void *data, size_t len, uint32_t h = 0x811c9dc5);
+
+////////////////////
+// workers.cpp
+////////////////////
+
+/** Calls func(i) for 0 <= i < count, spread across a persistent pool of worker threads and the calling thread.
+Returns once every call has finished. Nested calls run serially on the calling thread.
+*/
+void parallelFor(int count, const std::function<void(int)> &func);
 
 ////////////////////
 // wave.cpp
@@ -149,32 +285,98 @@ enum EffectID {
 
 extern const char *effectNames[EFFECTS_LEN];
 
+/** Stages of the effect chain. Some stages read more than one effect parameter. */
+enum EffectStageID {
+	STAGE_PRE_GAIN,
+	STAGE_SHIFT,
+	STAGE_COMB,
+	STAGE_RING,
+	STAGE_CHEBYSHEV,
+	STAGE_SAMPLE_AND_HOLD,
+	STAGE_QUANTIZATION,
+	STAGE_SLEW,
+	STAGE_FILTER,
+	EFFECT_STAGES_LEN
+};
+
+extern const char *effectStageNames[EFFECT_STAGES_LEN];
+
+#define EFFECT_CHAIN_LEN 16
+#define EFFECT_OVERSAMPLE_MAX 8
+
+/** The order in which the stages run. Stages can be repeated or disabled.
+Post gain, cycle and normalize always run after the chain.
+Unused slots are kept zeroed, so chains can be compared with memcmp.
+*/
+struct EffectChain {
+	int32_t len;
+	int8_t stages[EFFECT_CHAIN_LEN];
+	bool enabled[EFFECT_CHAIN_LEN];
+	/** Nonlinear stages run at this many times WAVE_LEN, so their harmonics above the Nyquist frequency are filtered out instead of folding back. 1, 2, 4 or 8. */
+	int32_t oversample;
+
+	/** Sets the fixed order which was used before chains were editable */
+	void reset();
+	/** Checks that a chain read from a file can be run */
+	bool valid() const;
+	void append(EffectStageID stage);
+	void remove(int index);
+	/** Moves the stage at index `from` to index `to`, shifting the stages in between */
+	void move(int from, int to);
+};
+
+/** Limits the memory used to keep the intermediate results of the effect chain.
+Each wave which was recently updated takes about 35 kB. A budget of 0 disables the cache.
+*/
+void effectCacheSetBudget(size_t bytes);
+size_t effectCacheGetBudget();
+size_t effectCacheGetUsage();
+/** Recent average time in seconds for the effect chain to process one wave */
+double effectChainGetCost();
+
 struct Wave {
 	float samples[WAVE_LEN];
-	/** FFT of wave, interleaved complex numbers */
+	/** FFT of wave, interleaved complex numbers. Computed on demand by updateSpectrum(). */
 	float spectrum[WAVE_LEN];
 	/** Norm of spectrum */
 	float harmonics[WAVE_LEN / 2];
 	/** Wave after effects have been applied */
 	float postSamples[WAVE_LEN];
+	/** Computed on demand by updatePostSpectrum() */
 	float postSpectrum[WAVE_LEN];
 	float postHarmonics[WAVE_LEN / 2];
 
 	float effects[EFFECTS_LEN];
 	bool cycle;
 	bool normalize;
+	/** Whether spectrum and harmonics, and postSpectrum and postHarmonics, are up to date.
+	They fill the padding after `normalize`, so the layout of saved banks doesn't change.
+	*/
+	bool spectrumValid;
+	bool postSpectrumValid;
 
 	void clear();
-	/** Generates post arrays from the sample array, by applying effects */
-	void updatePost();
-	void commitSamples();
-	void commitHarmonics();
-	void clearEffects();
+	/** Generates postSamples from the sample array by applying effects through `chain`, the chain of the bank holding the wave.
+	Marks postSpectrum and postHarmonics stale.
+	The methods below which change the samples or effects take the chain to pass on to updatePost().
+	*/
+	void updatePost(const EffectChain &chain);
+	/** Computes spectrum and harmonics if they are stale */
+	void updateSpectrum();
+	/** Computes postSpectrum and postHarmonics if they are stale */
+	void updatePostSpectrum();
+	/** Harmonics can be edited in place, followed by commitHarmonics() */
+	float *getHarmonics();
+	const float *getPostHarmonics();
+	void commitSamples(const EffectChain &chain);
+	void commitHarmonics(const EffectChain &chain);
+	void clearEffects(const EffectChain &chain);
 	/** Applies effects to the sample array and resets the effect parameters */
-	void bakeEffects();
-	void randomizeEffects();
-	void saveWAV(const char *filename);
-	void loadWAV(const char *filename);
+	void bakeEffects(const EffectChain &chain);
+	void randomizeEffects(const EffectChain &chain);
+	/** Returns false if the file couldn't be written. `dither` and `ditherSeed` are passed to f32_to_i16(). */
+	bool saveWAV(const char *filename, Dither dither, uint32_t ditherSeed = 0);
+	void loadWAV(const char *filename, const EffectChain &chain);
 	/** Writes to a global state */
 	void clipboardCopy();
 	void clipboardPaste();
@@ -194,27 +396,39 @@ extern bool clipboardActive;
 
 struct Bank {
 	Wave waves[BANK_LEN];
+	/** The chain which every wave of the bank is processed with.
+	Kept after the waves, so banks saved before it existed still load.
+	*/
+	EffectChain chain;
 
 	void clear();
+	/** Regenerates postSamples of every wave in parallel. The spectra and harmonics are computed when first needed. */
+	void commitSamples();
+	/** Calls updatePost() on every wave, in parallel */
+	void updateAllPost();
+	/** Calls updatePost() on the `len` waves listed in `waveIds`, in parallel */
+	void updatePost(const int *waveIds, int len);
 	void swap(int i, int j);
 	void shuffle();
 	/** `in` must be length BANK_LEN * WAVE_LEN */
 	void setSamples(const float *in);
 	void getPostSamples(float *out);
 	void duplicateToAll(int waveId);
-	/** Binary dump of the bank struct */
-	void save(const char *filename);
+	/** Chunked bank file, described in bank.cpp. load() also reads the raw struct dumps of older versions.
+	save() writes a temporary file and renames it over `filename`, so a failed save leaves the old file intact. Returns false if it failed.
+	*/
+	bool save(const char *filename);
 	void load(const char *filename);
 	/** WAV file with BANK_LEN * WAVE_LEN samples: not used in OXIWave*/
-	void saveWAV(const char *filename);
+	bool saveWAV(const char *filename, Dither dither);
 	void loadWAV(const char *filename);
 	/** Saves/Loads each wave to its own file in a directory */
-	void saveWaves(const char *dirname);
+	bool saveWaves(const char *dirname, Dither dither);
 	void loadWaves(const char *dirname);
 	/** WAV file with each WAV in the bank repeated 8 times **/
 	void loadMultiWAVs(const char *filename);
 	void loadMultiWAVsOLD(const char *filename);
-	void exportMultiWAVs(const char *filename);
+	bool exportMultiWAVs(const char *filename, Dither dither);
 };
 
 
@@ -222,15 +436,91 @@ struct Bank {
 // history.cpp
 ////////////////////
 
-/** Call as much as you like. History will only be pushed if a time delay between the last call has occurred. */
+/** The state of a wave which everything else is derived from */
+struct WaveSource {
+	float samples[WAVE_LEN];
+	float effects[EFFECTS_LEN];
+	bool cycle;
+	bool normalize;
+
+	void set(const Wave *wave);
+	bool equals(const Wave *wave) const;
+	/** Copies to the wave and marks its spectrum stale. Doesn't update the post arrays. */
+	void apply(Wave *wave) const;
+};
+
+/** Losslessly encodes `source` as the XOR of its words against `parent`, or against the previous word if `parent` is NULL */
+void packSource(const WaveSource *source, const WaveSource *parent, std::vector<uint8_t> &packed);
+/** Returns false if `packed` is malformed */
+bool unpackSource(const std::vector<uint8_t> &packed, const WaveSource *parent, WaveSource *source);
+
+/** Opens a transaction, so all edits until historyCommit() are recorded as one undo step, e.g. for a gesture from mouse down to mouse up.
+Does nothing if a transaction is already open.
+*/
+void historyBegin();
+/** Records an edit of currentBank. Outside of a transaction, this pushes an undo step immediately. */
 void historyPush();
+/** Records an edit of a wave's effect parameters, opening a transaction if needed.
+The wave's effect chain is recomputed by the next historyUpdate(), together with the other touched waves.
+*/
+void historyTouch(int waveId);
+/** Recomputes the effect chains of waves touched since the last call, in parallel */
+void historyUpdate();
+/** Closes the transaction, pushing one undo step if anything was edited */
+void historyCommit();
 void historyUndo();
 void historyRedo();
 void historyClear();
+/** Limits the memory used by undo history. The oldest steps are compressed first, then moved to a temporary file, and read back when undone to. */
+void historySetBudget(size_t bytes);
+size_t historyGetBudget();
+size_t historyGetMemoryUsage();
+/** Bytes of history moved to the temporary file */
+size_t historyGetDiskUsage();
+/** Counts the steps pushed, undone and redone, so callers can tell whether the bank changed since they last looked */
+uint64_t historyGetChanges();
 
 extern Bank currentBank;
 
 
+////////////////////
+// journal.cpp
+////////////////////
+
+/** Starts an empty journal at `path`, replacing any previous one. History steps are appended to it as they are pushed. */
+void journalOpen(const char *path);
+/** Finishes writing and closes the journal. Deletes it unless `keep`, e.g. when the bank couldn't be saved on exit. */
+void journalClose(bool keep = false);
+/** Queues the new state of a wave or of the chain. Returns without waiting for the write. */
+void journalWave(int waveId, const Wave *wave);
+void journalChain(const EffectChain *chain);
+/** Marks the end of a history step. Recovery only applies whole steps. */
+void journalCommit();
+/** Drops the journaled edits which `saved` holds. Call after `saved` was written to the bank file the journal is recovered on top of. */
+void journalReset(const std::shared_ptr<const Bank> &saved);
+/** Applies the steps of a journal left behind by a crash to currentBank. Returns false if there was none. */
+bool journalRecover(const char *path);
+
+
+////////////////////
+// io.cpp
+////////////////////
+
+void ioInit();
+/** Finishes the queued saves before returning */
+void ioDestroy();
+/** Runs `run` on the I/O thread, after the saves queued before it. `run` must only use data it owns, such as a copy of the bank, and returns false if the save failed.
+`target` names the file or directory being written in the status.
+*/
+void ioRun(const char *target, const std::function<bool()> &run);
+/** Describes the most recent save, e.g. "Saved Untitled Wavetable.wav", or is empty */
+std::string ioGetStatus();
+/** Whether saves are queued or running */
+bool ioBusy();
+/** Saves a copy of currentBank on the I/O thread if the history changed and enough time passed since the last autosave. Call once per frame. */
+void ioAutosave(const char *filename);
+
+
 ////////////////////
 // catalog.cpp
 ////////////////////
@@ -274,6 +564,8 @@ int audioGetDeviceCount();
 const char *audioGetDeviceName(int deviceId);
 void audioClose();
 void audioOpen(int deviceId);
+/** Publishes the post samples of playingBank to the audio thread if they changed. Call once per frame, after the bank is edited. */
+void audioSyncBank();
 void audioInit();
 void audioDestroy();
 
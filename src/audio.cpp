@@ -1,4 +1,5 @@
 #include "WaveEdit.hpp"
+#include <string.h>
 #include <SDL.h>
 #include <samplerate.h>
 
@@ -27,6 +28,17 @@ static SDL_AudioDeviceID audioDevice = 0;
 static SDL_AudioSpec audioSpec;
 static SRC_STATE *audioSrc = NULL;
 
+/** postSamples of playingBank, one 64-byte aligned row per wave.
+The morph reads eight rows of this block per sample, instead of eight arrays spread across 11 kB Wave structs.
+*/
+struct PostSlab {
+	alignas(64) float samples[BANK_LEN][WAVE_LEN];
+};
+/** audioSyncBank() fills the slab the callback isn't reading, then swaps them */
+static PostSlab playingSlabs[2];
+/** The slab the audio callback reads. Only changed while the audio device is locked. */
+static PostSlab *playingSlab = &playingSlabs[0];
+
 
 long srcCallback(void *cb_data, float **data) {
 	float gain = powf(10.0, playVolume / 20.0);
@@ -75,22 +87,22 @@ long srcCallback(void *cb_data, float **data) {
 			int i_z1 = eucmodi(zi + 1, BANK_GRID_DIM3)*BANK_GRID_DIM1*BANK_GRID_DIM2;
 
 			float v0 = crossf(
-				playingBank->waves[i_z0 + i_y0 + i_x0].postSamples[index],
-				playingBank->waves[i_z0 + i_y0 + i_x1].postSamples[index],
+				playingSlab->samples[i_z0 + i_y0 + i_x0][index],
+				playingSlab->samples[i_z0 + i_y0 + i_x1][index],
 				xf);
 			float v1 = crossf(
-				playingBank->waves[i_z0 + i_y1 + i_x0].postSamples[index],
-				playingBank->waves[i_z0 + i_y1 + i_x1].postSamples[index],
+				playingSlab->samples[i_z0 + i_y1 + i_x0][index],
+				playingSlab->samples[i_z0 + i_y1 + i_x1][index],
 				xf);
 			float z0 = crossf(v0, v1, yf);
 
 			float v2 = crossf(
-				playingBank->waves[i_z1 + i_y0 + i_x0].postSamples[index],
-				playingBank->waves[i_z1 + i_y0 + i_x1].postSamples[index],
+				playingSlab->samples[i_z1 + i_y0 + i_x0][index],
+				playingSlab->samples[i_z1 + i_y0 + i_x1][index],
 				xf);
 			float v3 = crossf(
-				playingBank->waves[i_z1 + i_y1 + i_x0].postSamples[index],
-				playingBank->waves[i_z1 + i_y1 + i_x1].postSamples[index],
+				playingSlab->samples[i_z1 + i_y1 + i_x0][index],
+				playingSlab->samples[i_z1 + i_y1 + i_x1][index],
 				xf);
 			float z1 = crossf(v2, v3, yf);
 
@@ -101,8 +113,8 @@ long srcCallback(void *cb_data, float **data) {
 			int zi = browseSmooth;
 			float zf = browseSmooth - zi;
 			in[i] = crossf(
-				playingBank->waves[zi].postSamples[index],
-				playingBank->waves[eucmodi(zi + 1, BANK_LEN)].postSamples[index],
+				playingSlab->samples[zi][index],
+				playingSlab->samples[eucmodi(zi + 1, BANK_LEN)][index],
 				zf);
 		}
 
@@ -178,6 +190,29 @@ void audioCallback(void *userdata, Uint8 *stream, int len) {
 	}
 }
 
+void audioSyncBank() {
+	if (!playingBank)
+		return;
+	// Only this thread writes the slabs, so the playing one can be compared without the lock
+	int j = 0;
+	while (j < BANK_LEN && memcmp(playingSlab->samples[j], playingBank->waves[j].postSamples, sizeof(float) * WAVE_LEN) == 0)
+		j++;
+	if (j == BANK_LEN)
+		return;
+
+	// The callback never reads the other slab, so it is filled without holding the callback off
+	PostSlab *next = (playingSlab == &playingSlabs[0]) ? &playingSlabs[1] : &playingSlabs[0];
+	for (j = 0; j < BANK_LEN; j++) {
+		memcpy(next->samples[j], playingBank->waves[j].postSamples, sizeof(float) * WAVE_LEN);
+	}
+	if (audioDevice > 0)
+		SDL_LockAudioDevice(audioDevice);
+	playingSlab = next;
+	if (audioDevice > 0)
+		SDL_UnlockAudioDevice(audioDevice);
+}
+
+
 int audioGetDeviceCount() {
 	return SDL_GetNumAudioDevices(0);
 }
@@ -1,15 +1,37 @@
 #include "WaveEdit.hpp"
 #include <string.h>
 #include <sndfile.h>
+#include <algorithm>
 
 
 void Bank::clear() {
 	// The lazy way
 	memset(this, 0, sizeof(Bank));
+	chain.reset();
+	commitSamples();
+}
 
-	for (int i = 0; i < BANK_LEN; i++) {
-		waves[i].commitSamples();
+
+void Bank::commitSamples() {
+	parallelFor(BANK_LEN, [this](int j) {
+		waves[j].commitSamples(chain);
+	});
+}
+
+
+void Bank::updateAllPost() {
+	int waveIds[BANK_LEN];
+	for (int j = 0; j < BANK_LEN; j++) {
+		waveIds[j] = j;
 	}
+	updatePost(waveIds, BANK_LEN);
+}
+
+
+void Bank::updatePost(const int *waveIds, int len) {
+	parallelFor(len, [this, waveIds](int j) {
+		waves[waveIds[j]].updatePost(chain);
+	});
 }
 
 
@@ -31,8 +53,8 @@ void Bank::shuffle() {
 void Bank::setSamples(const float *in) {
 	for (int j = 0; j < BANK_LEN; j++) {
 		memcpy(waves[j].samples, &in[j * WAVE_LEN], sizeof(float) * WAVE_LEN);
-		waves[j].commitSamples();
 	}
+	commitSamples();
 }
 
 
@@ -51,15 +73,267 @@ void Bank::duplicateToAll(int waveId) {
 	}
 }
 
+/*
+Bank files are a sequence of chunks. Every number is stored little-endian.
+	"OXWB", uint32 version
+	chunks: char id[4], uint32 len, `len` bytes of payload, uint32 fnv1a() of the payload
+		GRID  uint32 dim1, dim2, dim3, waveLen
+		WAVE  uint32 index, uint32 effectsLen, float samples[waveLen], float effects[effectsLen], uint8 cycle, uint8 normalize
+		CHAN  int32 len, int8 stages[len], uint8 enabled[len], int32 oversample
+		POST  uint32 postVersion, uint32 fnv1a() of the GRID, WAVE and CHAN payloads, float postSamples[BANK_LEN * waveLen]
+POST is only a cache. It is used if its version and hash match, so loading doesn't have to run the effects.
+Readers skip chunks they don't know. Files without the magic are raw dumps of the Bank struct from older versions.
+*/
+
+static const char bankMagic[4] = {'O', 'X', 'W', 'B'};
+static const uint32_t bankVersion = 1;
+/** Bump when the effects produce different postSamples from the same sources, so old POST chunks are recomputed */
+static const uint32_t bankPostVersion = 1;
+
+
+static void putU32(std::vector<uint8_t> &out, uint32_t x) {
+	for (int i = 0; i < 4; i++) {
+		out.push_back(x >> (8 * i));
+	}
+}
+
+static void putF32(std::vector<uint8_t> &out, float x) {
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	putU32(out, bits);
+}
+
+static void putChunk(std::vector<uint8_t> &out, const char *id, const std::vector<uint8_t> &payload) {
+	out.insert(out.end(), id, id + 4);
+	putU32(out, payload.size());
+	out.insert(out.end(), payload.begin(), payload.end());
+	putU32(out, fnv1a(payload.data(), payload.size()));
+}
+
+
+/** Reads little-endian values, and stays failed once a read goes past the end */
+struct BankReader {
+	const uint8_t *p;
+	const uint8_t *end;
+	bool ok = true;
+
+	BankReader(const uint8_t *p, size_t len) : p(p), end(p + len) {}
+
+	bool has(size_t len) {
+		ok = ok && (size_t) (end - p) >= len;
+		return ok;
+	}
+	uint32_t u32() {
+		if (!has(4))
+			return 0;
+		uint32_t x = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+		p += 4;
+		return x;
+	}
+	float f32() {
+		uint32_t bits = u32();
+		float x;
+		memcpy(&x, &bits, sizeof(x));
+		return x;
+	}
+	uint8_t u8() {
+		if (!has(1))
+			return 0;
+		return *p++;
+	}
+};
+
+
 /* Save autosave data */
-void Bank::save(const char *filename) {
-	FILE *f = fopen(filename, "wb");
+bool Bank::save(const char *filename) {
+	std::vector<uint8_t> out;
+	out.insert(out.end(), bankMagic, bankMagic + 4);
+	putU32(out, bankVersion);
+
+	std::vector<uint8_t> payload;
+	putU32(payload, BANK_GRID_DIM1);
+	putU32(payload, BANK_GRID_DIM2);
+	putU32(payload, BANK_GRID_DIM3);
+	putU32(payload, WAVE_LEN);
+	putChunk(out, "GRID", payload);
+	uint32_t hash = fnv1a(payload.data(), payload.size());
+
+	for (int i = 0; i < BANK_LEN; i++) {
+		const Wave &wave = waves[i];
+		payload.clear();
+		putU32(payload, i);
+		putU32(payload, EFFECTS_LEN);
+		for (int k = 0; k < WAVE_LEN; k++) {
+			putF32(payload, wave.samples[k]);
+		}
+		for (int k = 0; k < EFFECTS_LEN; k++) {
+			putF32(payload, wave.effects[k]);
+		}
+		payload.push_back(wave.cycle);
+		payload.push_back(wave.normalize);
+		putChunk(out, "WAVE", payload);
+		hash = fnv1a(payload.data(), payload.size(), hash);
+	}
+
+	payload.clear();
+	putU32(payload, chain.len);
+	for (int k = 0; k < chain.len; k++) {
+		payload.push_back(chain.stages[k]);
+	}
+	for (int k = 0; k < chain.len; k++) {
+		payload.push_back(chain.enabled[k]);
+	}
+	putU32(payload, chain.oversample);
+	putChunk(out, "CHAN", payload);
+	hash = fnv1a(payload.data(), payload.size(), hash);
+
+	payload.clear();
+	putU32(payload, bankPostVersion);
+	putU32(payload, hash);
+	for (int i = 0; i < BANK_LEN; i++) {
+		for (int k = 0; k < WAVE_LEN; k++) {
+			putF32(payload, waves[i].postSamples[k]);
+		}
+	}
+	putChunk(out, "POST", payload);
+
+	std::string tmpFilename = stringf("%s.tmp", filename);
+	FILE *f = fopen(tmpFilename.c_str(), "wb");
 	if (!f)
-		return;
-	fwrite(this, sizeof(*this), 1, f);
-	fclose(f);
+		return false;
+	bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok) {
+		remove(tmpFilename.c_str());
+		return false;
+	}
+#if defined(ARCH_WIN)
+	// rename() doesn't replace existing files on Windows
+	remove(filename);
+#endif
+	return rename(tmpFilename.c_str(), filename) == 0;
 }
 
+
+/** Returns false if the file can't be loaded at all. Damaged chunks are skipped, leaving their part of the bank cleared. */
+static bool loadChunks(Bank *bank, const uint8_t *data, size_t len) {
+	BankReader file(data, len);
+	if (!file.has(4) || memcmp(file.p, bankMagic, 4) != 0)
+		return false;
+	file.p += 4;
+	uint32_t version = file.u32();
+	if (!file.ok || version > bankVersion) {
+		printf("Bank file version %u is newer than this version of OXIWave\n", version);
+		return false;
+	}
+
+	uint32_t hash = fnv1a(NULL, 0);
+	bool postValid = false;
+	bool damaged = false;
+	while (file.p < file.end) {
+		// A truncated file keeps the chunks before the cut
+		if (!file.has(8)) {
+			damaged = true;
+			break;
+		}
+		const char *id = (const char*) file.p;
+		file.p += 4;
+		uint32_t chunkLen = file.u32();
+		if (!file.has((size_t) chunkLen + 4)) {
+			damaged = true;
+			break;
+		}
+		const uint8_t *payload = file.p;
+		BankReader chunk(payload, chunkLen);
+		file.p += chunkLen;
+		// Damaged chunks are never hashed, so they also invalidate POST
+		if (file.u32() != fnv1a(payload, chunkLen)) {
+			damaged = true;
+			continue;
+		}
+
+		if (memcmp(id, "GRID", 4) == 0) {
+			uint32_t dim1 = chunk.u32();
+			uint32_t dim2 = chunk.u32();
+			uint32_t dim3 = chunk.u32();
+			uint32_t waveLen = chunk.u32();
+			if (!chunk.ok || dim1 != BANK_GRID_DIM1 || dim2 != BANK_GRID_DIM2 || dim3 != BANK_GRID_DIM3 || waveLen != WAVE_LEN) {
+				printf("Bank file has a %ux%ux%u grid of %u samples, which this version of OXIWave can't load\n", dim1, dim2, dim3, waveLen);
+				return false;
+			}
+			hash = fnv1a(payload, chunkLen, hash);
+		}
+		else if (memcmp(id, "WAVE", 4) == 0) {
+			uint32_t index = chunk.u32();
+			uint32_t effectsLen = chunk.u32();
+			if (!chunk.ok || index >= BANK_LEN || !chunk.has(4 * ((size_t) WAVE_LEN + effectsLen) + 2)) {
+				damaged = true;
+				continue;
+			}
+			hash = fnv1a(payload, chunkLen, hash);
+			Wave &wave = bank->waves[index];
+			for (int k = 0; k < WAVE_LEN; k++) {
+				wave.samples[k] = chunk.f32();
+			}
+			// Effects added after the file was saved stay at 0, and unknown ones are dropped
+			for (uint32_t k = 0; k < effectsLen; k++) {
+				float x = chunk.f32();
+				if (k < EFFECTS_LEN)
+					wave.effects[k] = x;
+			}
+			wave.cycle = chunk.u8();
+			wave.normalize = chunk.u8();
+		}
+		else if (memcmp(id, "CHAN", 4) == 0) {
+			EffectChain chain = {};
+			uint32_t chainLen = chunk.u32();
+			if (!chunk.ok || chainLen > EFFECT_CHAIN_LEN || !chunk.has(2 * chainLen + 4)) {
+				damaged = true;
+				continue;
+			}
+			hash = fnv1a(payload, chunkLen, hash);
+			chain.len = chainLen;
+			for (uint32_t k = 0; k < chainLen; k++) {
+				chain.stages[k] = chunk.u8();
+			}
+			for (uint32_t k = 0; k < chainLen; k++) {
+				chain.enabled[k] = chunk.u8();
+			}
+			chain.oversample = chunk.u32();
+			if (chain.valid())
+				bank->chain = chain;
+		}
+		else if (memcmp(id, "POST", 4) == 0) {
+			uint32_t postVersion = chunk.u32();
+			uint32_t postHash = chunk.u32();
+			if (postVersion != bankPostVersion || postHash != hash || !chunk.has(4 * (size_t) BANK_LEN * WAVE_LEN))
+				continue;
+			for (int i = 0; i < BANK_LEN; i++) {
+				for (int k = 0; k < WAVE_LEN; k++) {
+					bank->waves[i].postSamples[k] = chunk.f32();
+				}
+			}
+			postValid = true;
+		}
+	}
+
+	if (damaged)
+		printf("Skipped damaged parts of bank file\n");
+
+	if (postValid) {
+		// Spectra are computed from the loaded samples when first needed
+		for (int i = 0; i < BANK_LEN; i++) {
+			bank->waves[i].spectrumValid = false;
+			bank->waves[i].postSpectrumValid = false;
+		}
+	}
+	else {
+		bank->commitSamples();
+	}
+	return true;
+}
+
+
 /* Load autosave data */
 void Bank::load(const char *filename) {
 	clear();
@@ -67,29 +341,56 @@ void Bank::load(const char *filename) {
 	FILE *f = fopen(filename, "rb");
 	if (!f)
 		return;
-	fread(this, sizeof(*this), 1, f);
+	std::vector<uint8_t> data;
+	uint8_t buffer[1 << 16];
+	size_t len;
+	while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data.insert(data.end(), buffer, buffer + len);
+	}
 	fclose(f);
 
-	for (int j = 0; j < BANK_LEN; j++) {
-		waves[j].commitSamples();
+	if (data.size() >= 4 && memcmp(data.data(), bankMagic, 4) == 0) {
+		if (!loadChunks(this, data.data(), data.size())) {
+			printf("Could not load bank %s\n", filename);
+			clear();
+		}
+		return;
 	}
+
+	// Older versions dumped the Bank struct. Files saved before the effect chain existed end after the waves, so they keep the default chain.
+	memcpy(this, data.data(), std::min(data.size(), sizeof(*this)));
+	if (data.size() < sizeof(*this) || !chain.valid())
+		chain.reset();
+	commitSamples();
+}
+
+
+/** Quantizes the whole bank at once, so the dither doesn't repeat from wave to wave */
+static bool writePostSamples(Bank *bank, SNDFILE *sf, Dither dither) {
+	float *samples = new float[BANK_LEN * WAVE_LEN];
+	bank->getPostSamples(samples);
+	int16_t *samples_i16 = new int16_t[BANK_LEN * WAVE_LEN];
+	f32_to_i16(samples, samples_i16, BANK_LEN * WAVE_LEN, dither);
+	delete[] samples;
+
+	bool ok = sf_write_short(sf, samples_i16, BANK_LEN * WAVE_LEN) == BANK_LEN * WAVE_LEN;
+	delete[] samples_i16;
+	return ok;
 }
 
 
-void Bank::saveWAV(const char *filename) {
+bool Bank::saveWAV(const char *filename, Dither dither) {
 	SF_INFO info;
 	info.samplerate = SAMPLE_RATE;
 	info.channels = 1;
 	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
 	SNDFILE *sf = sf_open(filename, SFM_WRITE, &info);
 	if (!sf)
-		return;
+		return false;
 
-	for (int j = 0; j < BANK_LEN; j++) {
-		sf_write_float(sf, waves[j].postSamples, WAVE_LEN);
-	}
+	bool ok = writePostSamples(this, sf, dither);
 
-	sf_close(sf);
+	return sf_close(sf) == 0 && ok;
 }
 
 
@@ -103,20 +404,23 @@ void Bank::loadWAV(const char *filename) {
 
 	for (int i = 0; i < BANK_LEN; i++) {
 		sf_read_float(sf, waves[i].samples, WAVE_LEN);
-		waves[i].commitSamples();
 	}
+	commitSamples();
 
 	sf_close(sf);
 }
 
 
-void Bank::saveWaves(const char *dirname) {
+bool Bank::saveWaves(const char *dirname, Dither dither) {
+	bool ok = true;
 	for (int b = 0; b < BANK_LEN; b++) {
 		char filename[1024];
 		snprintf(filename, sizeof(filename), "%s/%02d.wav", dirname, b);
 
-		waves[b].saveWAV(filename);
+		// Continue the noise from wave to wave, like the multi-WAV export does
+		ok = waves[b].saveWAV(filename, dither, b * WAVE_LEN) && ok;
 	}
+	return ok;
 }
 
 void Bank::loadWaves(const char *dirname) {
@@ -124,7 +428,7 @@ void Bank::loadWaves(const char *dirname) {
 		char filename[1024];
 		snprintf(filename, sizeof(filename), "%s/%02d.wav", dirname, b);
 
-		waves[b].loadWAV(filename);
+		waves[b].loadWAV(filename, chain);
 	}
 }
 
@@ -139,10 +443,10 @@ void Bank::loadMultiWAVs(const char *filename) {
 
 	for (int i = 0; i < BANK_LEN; i++) {
 		sf_read_float(sf, waves[i].samples, WAVE_LEN);
-		waves[i].commitSamples();
 		//Skip next 7 repititions
 //		sf_seek(sf, WAVE_LEN * 7, SEEK_CUR);
 	}
+	commitSamples();
 
 	sf_close(sf);
 }
@@ -157,30 +461,27 @@ void Bank::loadMultiWAVsOLD(const char *filename) {
 
 	for (int i = 0; i < BANK_LEN; i++) {
 		sf_read_float(sf, waves[i].samples, WAVE_LEN);
-		waves[i].commitSamples();
 		//Skip next 7 repititions
 		sf_seek(sf, WAVE_LEN * 7, SEEK_CUR);
 	}
+	commitSamples();
 
 	sf_close(sf);
 }
 
 
 
-void Bank::exportMultiWAVs(const char *filename) {
+bool Bank::exportMultiWAVs(const char *filename, Dither dither) {
 	SF_INFO info;
 	info.samplerate = SAMPLE_RATE;
 	info.channels = 1;
 	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
 	SNDFILE *sf = sf_open(filename, SFM_WRITE, &info);
 	if (!sf)
-		return;
+		return false;
 
-	for (int j = 0; j < BANK_LEN; j++) {
-		for (int k = 0; k < 1; k++)
-			sf_write_float(sf, waves[j].postSamples, WAVE_LEN);
-	}
+	bool ok = writePostSamples(this, sf, dither);
 
-	sf_close(sf);
+	return sf_close(sf) == 0 && ok;
 }
 
@@ -97,13 +97,11 @@ void catalogInit() {
 			int length;
 			float *samples = loadAudio(filePath, &length);
 			if (samples) {
-				if (length == WAVE_LEN) {
+				if (length == WAVE_LEN)
 					memcpy(catalogFile.samples, samples, sizeof(float) * WAVE_LEN);
-					catalogCategory.files.push_back(catalogFile);
-				}
-				else {
-					printf("%s has length %d but needs %d\n", filePath, length, WAVE_LEN);
-				}
+				else
+					cyclicResample(samples, length, catalogFile.samples, WAVE_LEN);
+				catalogCategory.files.push_back(catalogFile);
 				delete[] samples;
 			}
 		}
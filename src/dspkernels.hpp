@@ -0,0 +1,90 @@
+/*
+Included by simd.cpp once per instruction set, with these defined:
+	DSP_NAME(name) - the name of a kernel for this instruction set
+	DSP_TARGET - function attributes which enable the instruction set
+
+The kernels are plain loops over restrict pointers, so the compiler vectorizes them for whatever DSP_TARGET allows.
+Keep them free of calls and branches which would prevent that, other than the inline functions of fastmath.hpp.
+*/
+
+DSP_TARGET static void DSP_NAME(scale)(float *__restrict x, float a, int len) {
+	for (int i = 0; i < len; i++) {
+		x[i] *= a;
+	}
+}
+
+DSP_TARGET static void DSP_NAME(cmult)(float *__restrict x, const float *__restrict y, int len) {
+	for (int k = 0; k < len; k++) {
+		float ar = x[2 * k];
+		float ai = x[2 * k + 1];
+		float br = y[2 * k];
+		float bi = y[2 * k + 1];
+		x[2 * k] = ar * br - ai * bi;
+		x[2 * k + 1] = ar * bi + ai * br;
+	}
+}
+
+DSP_TARGET static void DSP_NAME(norm)(const float *__restrict x, float *__restrict y, int len) {
+	for (int k = 0; k < len; k++) {
+		y[k] = 2.f * sqrtf(x[2 * k] * x[2 * k] + x[2 * k + 1] * x[2 * k + 1]);
+	}
+}
+
+DSP_TARGET static void DSP_NAME(rampMinMax)(const float *__restrict x, float a, float b, float c, int len, float *min, float *max) {
+	float lo = FLT_MAX;
+	float hi = -FLT_MAX;
+	for (int i = 0; i < len; i++) {
+		float v = a * x[i] + b * i + c;
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+	}
+	*min = lo;
+	*max = hi;
+}
+
+DSP_TARGET static void DSP_NAME(rampClamp)(const float *__restrict x, float *__restrict y, float a, float b, float c, float min, float max, int len) {
+	for (int i = 0; i < len; i++) {
+		float v = a * x[i] + b * i + c;
+		v = v > max ? max : v;
+		v = v < min ? min : v;
+		y[i] = v;
+	}
+}
+
+DSP_TARGET static void DSP_NAME(chebyshev)(float *__restrict x, float n, int len) {
+	for (int i = 0; i < len; i++) {
+		float v = x[i];
+		// Fold values outside [-1, 1] back in with 1 / x
+		v = (-1.f <= v && v <= 1.f) ? v : 1.f / v;
+		x[i] = fastsinf(n * fastasinf(v));
+	}
+}
+
+DSP_TARGET static float DSP_NAME(dot)(const float *__restrict x, const float *__restrict y, int len) {
+	// Relies on -ffast-math to reorder the sum into vector lanes
+	float sum = 0.f;
+	for (int i = 0; i < len; i++) {
+		sum += x[i] * y[i];
+	}
+	return sum;
+}
+
+DSP_TARGET static void DSP_NAME(i16ToF32)(const int16_t *__restrict x, float *__restrict y, int len) {
+	for (int i = 0; i < len; i++) {
+		y[i] = x[i] / 32767.f;
+	}
+}
+
+DSP_TARGET static void DSP_NAME(f32ToI16)(const float *__restrict x, int16_t *__restrict y, int len, float dither, uint32_t seed) {
+	for (int i = 0; i < len; i++) {
+		float v = x[i] * 32767.f + dither * tpdff(seed + i);
+		v = v > 32767.f ? 32767.f : v;
+		v = v < -32767.f ? -32767.f : v;
+		// Round half away from zero like roundf(), from the exact fractional part.
+		// Adding 0.5 before truncating would round 0.49999997 up, since the sum rounds to 1.
+		int32_t t = (int32_t) v;
+		float frac = v - (float) t;
+		t += (frac >= 0.5f) - (frac <= -0.5f);
+		y[i] = t;
+	}
+}
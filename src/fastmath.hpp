@@ -0,0 +1,91 @@
+#pragma once
+
+/*
+Branch-free float approximations of libm functions, written so loops calling them can be vectorized.
+Coefficients are from Cephes. Errors are the measured maximum against double precision libm, with -ffast-math:
+	fastsinf   |x| < 8192              1e-7 absolute
+	fastasinf  -1 <= x <= 1            4e-7 relative
+	fastexpf   -87 < x < 88            2e-7 relative
+	fastlogf   normal x > 0            2e-7 absolute, or relative where |log(x)| > 1
+	fastpowf   x > 0, |y log(x)| < 4   2e-6 relative
+Building with STRICT_MATH replaces them with libm calls, to check that results only change within these bounds.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+
+#ifdef STRICT_MATH
+
+inline float fastsinf(float x) {return sinf(x);}
+inline float fastasinf(float x) {return asinf(x);}
+inline float fastexpf(float x) {return expf(x);}
+inline float fastlogf(float x) {return logf(x);}
+inline float fastpowf(float x, float y) {return powf(x, y);}
+
+#else
+
+inline float fastsinf(float x) {
+	// Reduce to r on [-pi/4, pi/4] in quadrant q.
+	// This is done in double, since -ffast-math would fold the usual split float constants back together.
+	float q = roundf(x * (float) M_2_PI);
+	float r = (double) x - (double) q * M_PI_2;
+	float z = r * r;
+	float s = r + r * z * ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f);
+	float c = 1.f - 0.5f * z + z * z * ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f);
+	int32_t qi = (int32_t) q;
+	float y = (qi & 1) ? c : s;
+	return (qi & 2) ? -y : y;
+}
+
+inline float fastasinf(float x) {
+	float a = fabsf(x);
+	// Above 0.5, use asin(a) = pi/2 - 2 asin(sqrt((1 - a) / 2))
+	bool big = a > 0.5f;
+	float z = big ? 0.5f * (1.f - a) : a * a;
+	float s = big ? sqrtf(z) : a;
+	float p = s + s * z * ((((4.2163199048e-2f * z + 2.4181311049e-2f) * z + 4.5470025998e-2f) * z + 7.4953002686e-2f) * z + 1.6666752422e-1f);
+	float y = big ? (float) M_PI_2 - 2.f * p : p;
+	return copysignf(y, x);
+}
+
+inline float fastexpf(float x) {
+	// exp(x) = 2^n exp(r) with r on [-ln(2)/2, ln(2)/2]
+	float n = roundf(x * (float) M_LOG2E);
+	float r = (double) x - (double) n * M_LN2;
+	float z = r * r;
+	float y = (((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r + 1.6666665459e-1f) * r + 5.0000001201e-1f) * z + r + 1.f;
+	// Multiply by 2^n by adding to the exponent bits
+	int32_t bits;
+	memcpy(&bits, &y, sizeof(bits));
+	bits += (int32_t) n << 23;
+	memcpy(&y, &bits, sizeof(bits));
+	return y;
+}
+
+inline float fastlogf(float x) {
+	// log(x) = log(m) + e log(2) with m on [sqrt(1/2), sqrt(2))
+	int32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int32_t e = ((bits >> 23) & 0xff) - 126;
+	bits = (bits & 0x807fffff) | 0x3f000000;
+	float m;
+	memcpy(&m, &bits, sizeof(bits));
+	bool small = m < (float) M_SQRT1_2;
+	e = small ? e - 1 : e;
+	m = small ? m + m - 1.f : m - 1.f;
+	float fe = e;
+	float z = m * m;
+	float y = ((((((((7.0376836292e-2f * m - 1.1514610310e-1f) * m + 1.1676998740e-1f) * m - 1.2420140846e-1f) * m + 1.4249322787e-1f) * m - 1.6668057665e-1f) * m + 2.0000714765e-1f) * m - 2.4999993993e-1f) * m + 3.3333331174e-1f) * m * z;
+	y += -2.12194440e-4f * fe;
+	y += -0.5f * z;
+	return m + y + 0.693359375f * fe;
+}
+
+/** Only defined for x > 0, which is all the effect chain needs */
+inline float fastpowf(float x, float y) {
+	return fastexpf(y * fastlogf(x));
+}
+
+#endif
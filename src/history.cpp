@@ -1,46 +1,380 @@
 #include "WaveEdit.hpp"
-#include <SDL.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
 
 
 Bank currentBank;
 
-static std::vector<Bank> history;
+void WaveSource::set(const Wave *wave) {
+	memcpy(samples, wave->samples, sizeof(samples));
+	memcpy(effects, wave->effects, sizeof(effects));
+	cycle = wave->cycle;
+	normalize = wave->normalize;
+}
+
+bool WaveSource::equals(const Wave *wave) const {
+	return memcmp(samples, wave->samples, sizeof(samples)) == 0
+		&& memcmp(effects, wave->effects, sizeof(effects)) == 0
+		&& cycle == wave->cycle
+		&& normalize == wave->normalize;
+}
+
+void WaveSource::apply(Wave *wave) const {
+	memcpy(wave->samples, samples, sizeof(samples));
+	memcpy(wave->effects, effects, sizeof(effects));
+	wave->cycle = cycle;
+	wave->normalize = normalize;
+	wave->spectrumValid = false;
+}
+
+
+static const int sourceWords = (sizeof(WaveSource) + 3) / 4;
+
+// Residuals are split into byte planes since the high bytes are mostly zero, and runs of zero bytes are stored as a zero and a run length
+void packSource(const WaveSource *source, const WaveSource *parent, std::vector<uint8_t> &packed) {
+	uint32_t words[sourceWords] = {};
+	uint32_t parentWords[sourceWords] = {};
+	memcpy(words, source, sizeof(WaveSource));
+	if (parent)
+		memcpy(parentWords, parent, sizeof(WaveSource));
+
+	uint8_t planes[4 * sourceWords];
+	for (int i = 0; i < sourceWords; i++) {
+		uint32_t residual = words[i] ^ (parent ? parentWords[i] : (i > 0 ? words[i - 1] : 0));
+		for (int b = 0; b < 4; b++) {
+			planes[b * sourceWords + i] = residual >> (8 * b);
+		}
+	}
+
+	packed.clear();
+	for (int i = 0; i < 4 * sourceWords;) {
+		if (planes[i] != 0) {
+			packed.push_back(planes[i++]);
+			continue;
+		}
+		int run = 0;
+		while (i < 4 * sourceWords && planes[i] == 0 && run < 255) {
+			run++;
+			i++;
+		}
+		packed.push_back(0);
+		packed.push_back(run);
+	}
+	packed.shrink_to_fit();
+}
+
+bool unpackSource(const std::vector<uint8_t> &packed, const WaveSource *parent, WaveSource *source) {
+	uint8_t planes[4 * sourceWords];
+	int len = 0;
+	for (size_t j = 0; j < packed.size();) {
+		if (packed[j] != 0) {
+			if (len >= 4 * sourceWords)
+				return false;
+			planes[len++] = packed[j++];
+			continue;
+		}
+		if (j + 1 >= packed.size())
+			return false;
+		int run = packed[j + 1];
+		if (len + run > 4 * sourceWords)
+			return false;
+		memset(&planes[len], 0, run);
+		len += run;
+		j += 2;
+	}
+	if (len != 4 * sourceWords)
+		return false;
+
+	uint32_t words[sourceWords];
+	uint32_t parentWords[sourceWords] = {};
+	if (parent)
+		memcpy(parentWords, parent, sizeof(WaveSource));
+	for (int i = 0; i < sourceWords; i++) {
+		uint32_t residual = 0;
+		for (int b = 0; b < 4; b++) {
+			residual |= (uint32_t) planes[b * sourceWords + i] << (8 * b);
+		}
+		words[i] = residual ^ (parent ? parentWords[i] : (i > 0 ? words[i - 1] : 0));
+	}
+	memcpy(source, words, sizeof(WaveSource));
+	return true;
+}
+
+
+/** Memory held by blocks, and bytes written to the spill file */
+static size_t historyMemory = 0;
+static size_t historyDisk = 0;
+static size_t historyBudget = 16 << 20;
+/** Temporary file which compressed blocks are moved to when the history outgrows its budget. Deleted when closed. */
+static FILE *spillFile = NULL;
+
+/** Decoding a block decodes its parents first, so the chain of parents is cut off at this length */
+static const int maxDepth = 16;
+
+/** A WaveSource in history. As the history outgrows its budget, old blocks drop their resident copy and keep only the packed one, and then move the packed one to the spill file.
+get() brings them back transparently.
+*/
+struct HistoryBlock {
+	std::unique_ptr<WaveSource> source;
+	/** packSource() output, against `parent`. Packed on creation while the parent is at hand, so dropping `source` later costs nothing. */
+	std::vector<uint8_t> packed;
+	std::shared_ptr<HistoryBlock> parent;
+	int depth = 0;
+	/** Position of `packed` in the spill file, or -1 */
+	long spillOffset = -1;
+	size_t spillLen = 0;
+
+	HistoryBlock(const Wave *wave, const std::shared_ptr<HistoryBlock> &previous) {
+		source.reset(new WaveSource());
+		source->set(wave);
+		if (previous && previous->depth < maxDepth) {
+			parent = previous;
+			depth = previous->depth + 1;
+		}
+		packSource(source.get(), parent ? parent->get() : NULL, packed);
+		historyMemory += memory();
+	}
+
+	~HistoryBlock() {
+		historyMemory -= memory();
+	}
+
+	size_t memory() const {
+		return (source ? sizeof(WaveSource) : 0) + packed.capacity();
+	}
+
+	const WaveSource *get() {
+		if (source)
+			return source.get();
+		historyMemory -= memory();
+		if (packed.empty() && spillOffset >= 0) {
+			packed.resize(spillLen);
+			fseek(spillFile, spillOffset, SEEK_SET);
+			if (fread(packed.data(), 1, spillLen, spillFile) != spillLen)
+				printf("Could not read undo history from the spill file\n");
+		}
+		source.reset(new WaveSource());
+		unpackSource(packed, parent ? parent->get() : NULL, source.get());
+		historyMemory += memory();
+		return source.get();
+	}
+
+	void compress() {
+		if (!source)
+			return;
+		historyMemory -= memory();
+		source.reset();
+		historyMemory += memory();
+	}
+
+	void spill() {
+		if (source || packed.empty())
+			return;
+		if (spillOffset < 0) {
+			if (!spillFile)
+				spillFile = tmpfile();
+			if (!spillFile)
+				return;
+			fseek(spillFile, 0, SEEK_END);
+			spillOffset = ftell(spillFile);
+			spillLen = packed.size();
+			if (fwrite(packed.data(), 1, spillLen, spillFile) != spillLen) {
+				spillOffset = -1;
+				return;
+			}
+			historyDisk += spillLen;
+		}
+		historyMemory -= memory();
+		std::vector<uint8_t>().swap(packed);
+		historyMemory += memory();
+	}
+};
+
+/** One undo step. Waves which are unchanged from the previous step share its block, so a step only costs the waves it edited. */
+struct HistoryEntry {
+	std::shared_ptr<HistoryBlock> waves[BANK_LEN];
+	EffectChain chain;
+};
+
+static std::vector<HistoryEntry> history;
 static int currentIndex = -1;
-static double previousTime = -INFINITY;
-static const double delayTime = 0.2;
 
+/** Whether a transaction is open, and whether anything was edited since it was opened */
+static bool transactionOpen = false;
+static bool transactionEdited = false;
+/** Waves whose effect chains must be recomputed before the next snapshot */
+static bool touched[BANK_LEN] = {};
+static uint64_t historyChanges = 0;
 
-void historyPush() {
-	double time = SDL_GetTicks() / 1000.0;
-	if (time - previousTime >= delayTime) {
-		currentIndex++;
+
+/** Compresses the blocks of the oldest steps until the history fits its budget, then spills them.
+Blocks of the current step stay resident, since every new step is compared against them.
+*/
+static void historyTrim() {
+	for (int pass = 0; pass < 2; pass++) {
+		for (int e = 0; e < (int) history.size(); e++) {
+			if (historyGetMemoryUsage() <= historyBudget)
+				return;
+			if (e == currentIndex)
+				continue;
+			for (int i = 0; i < BANK_LEN; i++) {
+				HistoryBlock *block = history[e].waves[i].get();
+				if (block == history[currentIndex].waves[i].get())
+					continue;
+				if (pass == 0)
+					block->compress();
+				else
+					block->spill();
+			}
+		}
 	}
+}
 
+static void pushSnapshot() {
+	HistoryEntry entry;
+	for (int i = 0; i < BANK_LEN; i++) {
+		const Wave *wave = &currentBank.waves[i];
+		std::shared_ptr<HistoryBlock> previous;
+		if (currentIndex >= 0)
+			previous = history[currentIndex].waves[i];
+		if (previous && previous->get()->equals(wave)) {
+			entry.waves[i] = previous;
+		}
+		else {
+			entry.waves[i] = std::make_shared<HistoryBlock>(wave, previous);
+			journalWave(i, wave);
+		}
+	}
+	entry.chain = currentBank.chain;
+	if (currentIndex < 0 || memcmp(&history[currentIndex].chain, &entry.chain, sizeof(EffectChain)) != 0)
+		journalChain(&entry.chain);
+	journalCommit();
+
+	currentIndex++;
 	// Delete redo history
-	history.resize(currentIndex + 1);
+	history.resize(currentIndex);
+	history.push_back(entry);
+	historyChanges++;
+	historyTrim();
+}
+
+/** Restores the bank to a history entry. Only waves which differ are rerun through the effect chain, and their spectra are left to be computed on demand. */
+static void restoreSnapshot(const HistoryEntry &entry) {
+	bool chainChanged = memcmp(&currentBank.chain, &entry.chain, sizeof(EffectChain)) != 0;
+	currentBank.chain = entry.chain;
+	if (chainChanged)
+		journalChain(&entry.chain);
+
+	int changedIds[BANK_LEN];
+	int changedLen = 0;
+	for (int i = 0; i < BANK_LEN; i++) {
+		Wave *wave = &currentBank.waves[i];
+		const WaveSource *source = entry.waves[i]->get();
+		if (source->equals(wave)) {
+			if (chainChanged)
+				changedIds[changedLen++] = i;
+			continue;
+		}
+		source->apply(wave);
+		changedIds[changedLen++] = i;
+		journalWave(i, wave);
+	}
+	currentBank.updatePost(changedIds, changedLen);
+	journalCommit();
+	historyChanges++;
+}
+
+void historyBegin() {
+	if (transactionOpen)
+		return;
+	transactionOpen = true;
+	transactionEdited = false;
+}
+
+void historyPush() {
+	if (transactionOpen) {
+		transactionEdited = true;
+		return;
+	}
+	pushSnapshot();
+}
 
-	history[currentIndex] = currentBank;
-	previousTime = time;
+void historyTouch(int waveId) {
+	touched[waveId] = true;
+	historyBegin();
+	transactionEdited = true;
+}
+
+void historyUpdate() {
+	int touchedIds[BANK_LEN];
+	int touchedLen = 0;
+	for (int i = 0; i < BANK_LEN; i++) {
+		if (touched[i]) {
+			touchedIds[touchedLen++] = i;
+			touched[i] = false;
+		}
+	}
+	currentBank.updatePost(touchedIds, touchedLen);
+}
+
+void historyCommit() {
+	if (!transactionOpen)
+		return;
+	historyUpdate();
+	transactionOpen = false;
+	if (transactionEdited)
+		pushSnapshot();
 }
 
 void historyUndo() {
+	historyCommit();
 	if (currentIndex >= 1) {
 		currentIndex--;
-		currentBank = history[currentIndex];
-		previousTime = -INFINITY;
+		restoreSnapshot(history[currentIndex]);
+		historyTrim();
 	}
 }
 
 void historyRedo() {
+	historyCommit();
 	if ((int) history.size() > currentIndex + 1) {
 		currentIndex++;
-		currentBank = history[currentIndex];
-		previousTime = -INFINITY;
+		restoreSnapshot(history[currentIndex]);
+		historyTrim();
 	}
 }
 
 void historyClear() {
 	history.clear();
 	currentIndex = -1;
-	previousTime = -INFINITY;
+	transactionOpen = false;
+	transactionEdited = false;
+	if (spillFile) {
+		fclose(spillFile);
+		spillFile = NULL;
+	}
+	historyDisk = 0;
+}
+
+void historySetBudget(size_t bytes) {
+	historyBudget = bytes;
+	if (currentIndex >= 0)
+		historyTrim();
+}
+
+size_t historyGetBudget() {
+	return historyBudget;
+}
+
+size_t historyGetMemoryUsage() {
+	return historyMemory + history.size() * sizeof(HistoryEntry);
+}
+
+size_t historyGetDiskUsage() {
+	return historyDisk;
+}
+
+uint64_t historyGetChanges() {
+	return historyChanges;
 }
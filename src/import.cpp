@@ -28,6 +28,10 @@ static float *audioPreview = NULL;
 static char status[1024] = "";
 static Bank importBank;
 
+/** The resampled audio from the last computeImport(), which only changes when the view or trim does */
+static float importSamples[BANK_LEN * WAVE_LEN];
+static bool importSamplesValid = false;
+
 const int audioLenMin = 32;
 const int audioLenMax = BANK_LEN * WAVE_LEN * 100;
 
@@ -53,6 +57,7 @@ static void clearImport() {
 
 	status[0] = '\0';
 	importBank.clear();
+	importSamplesValid = false;
 }
 
 static void loadImport(const char *path) {
@@ -102,14 +107,12 @@ static float getAudioAmplitude() {
 	return max;
 }
 
-static void computeImport(float *samples) {
+static void computeImport(float *samples, ResampleQuality quality) {
 	if (!audio) {
 		currentBank.getPostSamples(samples);
 		return;
 	}
 
-	float importSamples[BANK_LEN * WAVE_LEN] = {};
-
 	// A bunch of weird constants to align the resampler correctly
 	// Basically x's and w's are indices for the audio array, y's are for the bank array
 	float wl = offset * audioLen;
@@ -130,7 +133,21 @@ static void computeImport(float *samples) {
 	int yri = roundf(yr);
 	float ratio = clampf(1.0 / zoom, 1/300.0, 300.0);
 
-	resample(audio + xli, xri - xli, importSamples + yli, yri - yli, ratio);
+	// Only resample again if the view changed, or a better quality is requested
+	static int lastXli, lastXri, lastYli, lastYri;
+	static float lastRatio;
+	static ResampleQuality lastQuality;
+	if (!(importSamplesValid && xli == lastXli && xri == lastXri && yli == lastYli && yri == lastYri && ratio == lastRatio && quality <= lastQuality)) {
+		memset(importSamples, 0, sizeof(importSamples));
+		resample(audio + xli, xri - xli, importSamples + yli, yri - yli, ratio, quality);
+		lastXli = xli;
+		lastXri = xri;
+		lastYli = yli;
+		lastYri = yri;
+		lastRatio = ratio;
+		lastQuality = quality;
+		importSamplesValid = true;
+	}
 
 	// Apply mode mixing and gain
 	switch (mode) {
@@ -145,21 +162,21 @@ static void computeImport(float *samples) {
 
 	float amp = powf(10.0, gain / 20.0);
 	for (int i = 0; i < BANK_LEN * WAVE_LEN; i++) {
-		importSamples[i] *= amp;
+		float importSample = amp * importSamples[i];
 
 		switch (mode) {
 			case CLEAR_IMPORT:
-				samples[i] = importSamples[i];
+				samples[i] = importSample;
 				break;
 			case OVERWRITE_IMPORT:
 				if (yli <= i && i <= yri)
-					samples[i] = importSamples[i];
+					samples[i] = importSample;
 				break;
 			case ADD_IMPORT:
-				samples[i] += importSamples[i];
+				samples[i] += importSample;
 				break;
 			case MULTIPLY_IMPORT:
-				samples[i] *= importSamples[i];
+				samples[i] *= importSample;
 				break;
 		}
 	}
@@ -213,7 +230,10 @@ void importPage() {
 		ImGui::Text("Bank Preview");
 		// Initialize from previous bank
 		float bankSamples[BANK_LEN * WAVE_LEN];
-		computeImport(bankSamples);
+		// Keep dragging responsive on long files, and refine once the mouse is released
+		computeImport(bankSamples, ImGui::IsAnyItemActive() ? RESAMPLE_DRAFT : RESAMPLE_HIGH);
+		// Preview with the chain the waves will be imported into
+		importBank.chain = currentBank.chain;
 		importBank.setSamples(bankSamples);
 		float deltaBank = renderBankWave("bank preview", 200.0, bankSamples,
 			BANK_LEN * WAVE_LEN,
@@ -288,7 +308,16 @@ void importPage() {
 			}
 			ImGui::SameLine();
 			if (ImGui::Button("Import")) {
-				currentBank = importBank;
+				// The preview may still be in draft quality
+				float bankSamples[BANK_LEN * WAVE_LEN];
+				computeImport(bankSamples, RESAMPLE_HIGH);
+				// Only the waves are imported, so the user's effect chain and oversampling stay
+				importBank.chain = currentBank.chain;
+				importBank.setSamples(bankSamples);
+				for (int i = 0; i < BANK_LEN; i++) {
+					currentBank.waves[i] = importBank.waves[i];
+				}
+				historyPush();
 				clearImport();
 			}
 		}
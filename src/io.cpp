@@ -0,0 +1,129 @@
+#include "WaveEdit.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <memory>
+
+
+struct IOJob {
+	/** The file or directory being written, for the status */
+	std::string target;
+	/** Only failures are reported, e.g. for autosaves */
+	bool quiet;
+	std::function<bool()> run;
+};
+
+/** Runs saves one at a time on its own thread, in the order they were queued */
+struct IOWorker {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<IOJob> queue;
+	bool quit = false;
+	/** Jobs queued or running */
+	int pending = 0;
+	std::string status;
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cv.wait(lock, [&] {return quit || !queue.empty();});
+			// Finish queued saves before quitting, so nothing the user saved is lost
+			if (queue.empty())
+				return;
+			IOJob job = queue.front();
+			queue.pop_front();
+			if (!job.quiet)
+				status = stringf("Saving %s...", job.target.c_str());
+			lock.unlock();
+
+			bool ok = job.run();
+			if (!ok)
+				printf("Could not save %s\n", job.target.c_str());
+
+			lock.lock();
+			if (!ok)
+				status = stringf("Could not save %s", job.target.c_str());
+			else if (!job.quiet)
+				status = stringf("Saved %s", job.target.c_str());
+			pending--;
+		}
+	}
+};
+
+static IOWorker *io = NULL;
+
+
+void ioInit() {
+	io = new IOWorker();
+	io->thread = std::thread(&IOWorker::run, io);
+}
+
+void ioDestroy() {
+	{
+		std::lock_guard<std::mutex> lock(io->mutex);
+		io->quit = true;
+	}
+	io->cv.notify_one();
+	io->thread.join();
+	delete io;
+	io = NULL;
+}
+
+static void ioQueue(const char *target, bool quiet, const std::function<bool()> &run) {
+	IOJob job;
+	job.target = target;
+	job.quiet = quiet;
+	job.run = run;
+	{
+		std::lock_guard<std::mutex> lock(io->mutex);
+		io->queue.push_back(job);
+		io->pending++;
+	}
+	io->cv.notify_one();
+}
+
+void ioRun(const char *target, const std::function<bool()> &run) {
+	ioQueue(target, false, run);
+}
+
+std::string ioGetStatus() {
+	std::lock_guard<std::mutex> lock(io->mutex);
+	return io->status;
+}
+
+bool ioBusy() {
+	std::lock_guard<std::mutex> lock(io->mutex);
+	return io->pending > 0;
+}
+
+
+/** Seconds between autosaves of an edited bank */
+static const double autosaveInterval = 30.0;
+
+void ioAutosave(const char *filename) {
+	static uint64_t savedChanges = 0;
+	static std::chrono::steady_clock::time_point savedTime = std::chrono::steady_clock::now();
+
+	uint64_t changes = historyGetChanges();
+	if (changes == savedChanges)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	if (std::chrono::duration<double>(now - savedTime).count() < autosaveInterval)
+		return;
+	// Let a slow disk finish the previous save instead of piling up copies of the bank
+	if (ioBusy())
+		return;
+
+	savedChanges = changes;
+	savedTime = now;
+	std::shared_ptr<Bank> bank = std::make_shared<Bank>(currentBank);
+	std::string path = filename;
+	ioQueue(filename, true, [bank, path] {
+		if (!bank->save(path.c_str()))
+			return false;
+		journalReset(bank);
+		return true;
+	});
+}
@@ -0,0 +1,357 @@
+#include "WaveEdit.hpp"
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+
+
+/*
+The journal is written in native byte order, since it is only read back by the same machine after a crash.
+	"OXJ1"
+	records: uint32 type, uint32 index, uint32 len, uint32 checksum, then `len` bytes of payload
+A wave record holds packSource() of the wave against the previous record of the same wave, or against nothing for its first record.
+A chain record holds an EffectChain. A commit record ends a history step.
+After each autosave, the journal is replaced by one holding only the waves and chain which differ from the saved bank, so it doesn't grow for the whole session.
+*/
+
+enum JournalRecordType {
+	JOURNAL_WAVE = 1,
+	JOURNAL_CHAIN,
+	JOURNAL_COMMIT,
+	/** Not written, asks the writer to reset the journal against a saved bank */
+	JOURNAL_RESET,
+};
+
+struct JournalRecordHeader {
+	uint32_t type;
+	uint32_t index;
+	uint32_t len;
+	uint32_t checksum;
+};
+
+static const char journalMagic[4] = {'O', 'X', 'J', '1'};
+
+
+struct JournalOp {
+	JournalRecordType type;
+	int index;
+	WaveSource source;
+	EffectChain chain;
+	std::shared_ptr<const Bank> saved;
+};
+
+/** Packs and writes records on its own thread, so the UI thread only copies the wave into the queue */
+struct JournalWriter {
+	std::string path;
+	FILE *file = NULL;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<JournalOp> queue;
+	bool quit = false;
+
+	/** The last state written for each wave, which its next record is packed against */
+	WaveSource written[BANK_LEN];
+	bool writtenValid[BANK_LEN] = {};
+	EffectChain writtenChain;
+	bool writtenChainValid = false;
+	/** Whether records were written since the last commit, in which case a reset waits for the commit */
+	bool stepOpen = false;
+	std::shared_ptr<const Bank> resetBank;
+	/** Set after a failed write, since records after a gap can't be recovered */
+	bool failed = false;
+
+	void push(const JournalOp &op) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(op);
+		}
+		cv.notify_one();
+	}
+
+	/** Returns false if the record couldn't be written */
+	static bool writeRecord(FILE *f, JournalRecordType type, int index, const uint8_t *payload, size_t len) {
+		JournalRecordHeader header;
+		header.type = type;
+		header.index = index;
+		header.len = len;
+		header.checksum = fnv1a(payload, len);
+		if (fwrite(&header, sizeof(header), 1, f) != 1)
+			return false;
+		if (len > 0 && fwrite(payload, 1, len, f) != len)
+			return false;
+		return true;
+	}
+
+	void write(const JournalOp &op) {
+		if (failed)
+			return;
+		bool ok;
+		if (op.type == JOURNAL_WAVE) {
+			std::vector<uint8_t> packed;
+			packSource(&op.source, writtenValid[op.index] ? &written[op.index] : NULL, packed);
+			ok = writeRecord(file, JOURNAL_WAVE, op.index, packed.data(), packed.size());
+			written[op.index] = op.source;
+			writtenValid[op.index] = true;
+			stepOpen = true;
+		}
+		else if (op.type == JOURNAL_CHAIN) {
+			ok = writeRecord(file, JOURNAL_CHAIN, 0, (const uint8_t*) &op.chain, sizeof(EffectChain));
+			writtenChain = op.chain;
+			writtenChainValid = true;
+			stepOpen = true;
+		}
+		else if (op.type == JOURNAL_COMMIT) {
+			ok = writeRecord(file, JOURNAL_COMMIT, 0, NULL, 0);
+			// Hand the step to the OS, so it survives the process crashing
+			ok = fflush(file) == 0 && ok;
+			stepOpen = false;
+		}
+		else {
+			resetBank = op.saved;
+			ok = true;
+		}
+		if (!ok) {
+			printf("Could not write journal %s, edits won't be recoverable after a crash\n", path.c_str());
+			failed = true;
+			return;
+		}
+		if (resetBank && !stepOpen)
+			reset();
+	}
+
+	/** Replaces the journal with one holding the written waves and chain which differ from resetBank.
+	The bank file already holds resetBank, so the new journal recovers the same state on top of it.
+	*/
+	void reset() {
+		std::shared_ptr<const Bank> saved = resetBank;
+		resetBank.reset();
+
+		bool keepWaves[BANK_LEN];
+		int kept = 0;
+		for (int i = 0; i < BANK_LEN; i++) {
+			keepWaves[i] = writtenValid[i] && !written[i].equals(&saved->waves[i]);
+			kept += keepWaves[i];
+		}
+		bool keepChain = writtenChainValid && memcmp(&writtenChain, &saved->chain, sizeof(EffectChain)) != 0;
+
+		// The old journal stays in place until the new one is complete, so a crash during the reset loses nothing
+		std::string tmpPath = path + ".tmp";
+		FILE *f = fopen(tmpPath.c_str(), "wb");
+		if (!f) {
+			printf("Could not reset journal %s\n", path.c_str());
+			return;
+		}
+		bool ok = fwrite(journalMagic, sizeof(journalMagic), 1, f) == 1;
+		for (int i = 0; i < BANK_LEN && ok; i++) {
+			if (!keepWaves[i])
+				continue;
+			std::vector<uint8_t> packed;
+			packSource(&written[i], NULL, packed);
+			ok = writeRecord(f, JOURNAL_WAVE, i, packed.data(), packed.size());
+		}
+		if (ok && keepChain)
+			ok = writeRecord(f, JOURNAL_CHAIN, 0, (const uint8_t*) &writtenChain, sizeof(EffectChain));
+		if (ok && (kept > 0 || keepChain))
+			ok = writeRecord(f, JOURNAL_COMMIT, 0, NULL, 0);
+		ok = fclose(f) == 0 && ok;
+		if (!ok) {
+			printf("Could not reset journal %s\n", path.c_str());
+			remove(tmpPath.c_str());
+			return;
+		}
+
+		fclose(file);
+#if defined(ARCH_WIN)
+		// rename() doesn't replace existing files on Windows
+		remove(path.c_str());
+#endif
+		bool renamed = rename(tmpPath.c_str(), path.c_str()) == 0;
+		file = fopen(path.c_str(), "ab");
+		if (!file) {
+			printf("Could not reopen journal %s, edits won't be recoverable after a crash\n", path.c_str());
+			failed = true;
+			return;
+		}
+		if (!renamed) {
+			// Keep appending to the old journal, whose records are still packed against `written`
+			printf("Could not reset journal %s\n", path.c_str());
+			remove(tmpPath.c_str());
+			return;
+		}
+		// Waves left out of the new journal get a whole record when they are next written
+		for (int i = 0; i < BANK_LEN; i++) {
+			if (!keepWaves[i])
+				writtenValid[i] = false;
+		}
+		writtenChainValid = keepChain;
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cv.wait(lock, [&] {return quit || !queue.empty();});
+			if (queue.empty())
+				return;
+			std::deque<JournalOp> ops;
+			ops.swap(queue);
+			lock.unlock();
+			for (const JournalOp &op : ops) {
+				write(op);
+			}
+			lock.lock();
+		}
+	}
+};
+
+static JournalWriter *journal = NULL;
+
+
+void journalOpen(const char *path) {
+	journalClose();
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		printf("Could not open journal %s, edits won't be recoverable after a crash\n", path);
+		return;
+	}
+	if (fwrite(journalMagic, sizeof(journalMagic), 1, file) != 1) {
+		printf("Could not write journal %s, edits won't be recoverable after a crash\n", path);
+		fclose(file);
+		return;
+	}
+
+	journal = new JournalWriter();
+	journal->path = path;
+	journal->file = file;
+	journal->thread = std::thread(&JournalWriter::run, journal);
+}
+
+void journalClose(bool keep) {
+	if (!journal)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(journal->mutex);
+		journal->quit = true;
+	}
+	journal->cv.notify_one();
+	journal->thread.join();
+	if (journal->file)
+		fclose(journal->file);
+	if (!keep)
+		remove(journal->path.c_str());
+	delete journal;
+	journal = NULL;
+}
+
+void journalWave(int waveId, const Wave *wave) {
+	if (!journal)
+		return;
+	JournalOp op = {};
+	op.type = JOURNAL_WAVE;
+	op.index = waveId;
+	op.source.set(wave);
+	journal->push(op);
+}
+
+void journalChain(const EffectChain *chain) {
+	if (!journal)
+		return;
+	JournalOp op = {};
+	op.type = JOURNAL_CHAIN;
+	op.index = 0;
+	op.chain = *chain;
+	journal->push(op);
+}
+
+void journalCommit() {
+	if (!journal)
+		return;
+	JournalOp op = {};
+	op.type = JOURNAL_COMMIT;
+	op.index = 0;
+	journal->push(op);
+}
+
+void journalReset(const std::shared_ptr<const Bank> &saved) {
+	if (!journal)
+		return;
+	JournalOp op = {};
+	op.type = JOURNAL_RESET;
+	op.index = 0;
+	op.saved = saved;
+	journal->push(op);
+}
+
+
+bool journalRecover(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	char magic[4];
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, journalMagic, sizeof(magic)) != 0) {
+		fclose(f);
+		return false;
+	}
+
+	// Decoded like the writer packed them, but only applied to the bank at each commit, so a step torn by the crash is dropped
+	static WaveSource states[BANK_LEN];
+	bool statesValid[BANK_LEN] = {};
+	bool pendingWaves[BANK_LEN] = {};
+	EffectChain pendingChain;
+	bool pendingChainValid = false;
+	int steps = 0;
+
+	std::vector<uint8_t> payload;
+	JournalRecordHeader header;
+	while (fread(&header, sizeof(header), 1, f) == 1) {
+		// Larger than any record the writer makes
+		if (header.len > 2 * sizeof(WaveSource))
+			break;
+		payload.resize(header.len);
+		if (header.len > 0 && fread(payload.data(), 1, header.len, f) != header.len)
+			break;
+		if (fnv1a(payload.data(), header.len) != header.checksum)
+			break;
+
+		if (header.type == JOURNAL_WAVE) {
+			if (header.index >= BANK_LEN)
+				break;
+			WaveSource source;
+			if (!unpackSource(payload, statesValid[header.index] ? &states[header.index] : NULL, &source))
+				break;
+			states[header.index] = source;
+			statesValid[header.index] = true;
+			pendingWaves[header.index] = true;
+		}
+		else if (header.type == JOURNAL_CHAIN) {
+			if (header.len != sizeof(EffectChain))
+				break;
+			memcpy(&pendingChain, payload.data(), sizeof(EffectChain));
+			if (!pendingChain.valid())
+				break;
+			pendingChainValid = true;
+		}
+		else if (header.type == JOURNAL_COMMIT) {
+			for (int i = 0; i < BANK_LEN; i++) {
+				if (pendingWaves[i])
+					states[i].apply(&currentBank.waves[i]);
+				pendingWaves[i] = false;
+			}
+			if (pendingChainValid)
+				currentBank.chain = pendingChain;
+			pendingChainValid = false;
+			steps++;
+		}
+		else {
+			break;
+		}
+	}
+	fclose(f);
+
+	if (steps == 0)
+		return false;
+	currentBank.commitSamples();
+	printf("Recovered %d steps of edits from %s\n", steps, path);
+	return true;
+}
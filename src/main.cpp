@@ -44,6 +44,7 @@ __asm__(".symver realpath,realpath@GLIBC_2.2.5");
 
 int main(int argc, char **argv) {
 	srand(time(NULL));
+	simdInit();
 
 #ifdef ARCH_MAC
 	fixWorkingDirectory();
@@ -80,7 +81,17 @@ int main(int argc, char **argv) {
 	uiInit();
 	historyClear();
 	currentBank.load("autosave.dat");
+	// A journal is only left behind if the last session didn't exit cleanly, so its edits are newer than the autosave.
+	// They are saved before journalOpen() replaces the journal holding them.
+	if (journalRecover("autosave.journal") && !currentBank.save("autosave.dat")) {
+		// Keep the only copy of the recovered edits on disk. The new journal gets them too, with the first history step.
+		remove("autosave.journal.recovered");
+		rename("autosave.journal", "autosave.journal.recovered");
+		printf("Could not save the recovered edits to autosave.dat, kept their journal as autosave.journal.recovered\n");
+	}
+	journalOpen("autosave.journal");
 	historyPush();
+	ioInit();
 	catalogInit();
 	audioInit();
 	//dbInit();
@@ -125,6 +136,7 @@ int main(int argc, char **argv) {
 			// Build render buffer
 			uiRender();
 		}
+		ioAutosave("autosave.dat");
 
 		// Render frame
 		glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x, (int)ImGui::GetIO().DisplaySize.y);
@@ -135,7 +147,13 @@ int main(int argc, char **argv) {
 		SDL_GL_SwapWindow(window);
 	}
 
-	currentBank.save("autosave.dat");
+	// Finish saves still in progress, so the final autosave isn't overwritten by an older one
+	ioDestroy();
+	// Without a saved bank, the journal is needed to recover the session's edits on the next launch
+	bool saved = currentBank.save("autosave.dat");
+	if (!saved)
+		printf("Could not save autosave.dat, keeping autosave.journal\n");
+	journalClose(!saved);
 
 	// Cleanup
 	uiDestroy();
@@ -1,81 +1,525 @@
 #include "WaveEdit.hpp"
 #include <string.h>
 #include "pffft/pffft.h"
-#include <samplerate.h>
+#include <map>
+#include <mutex>
 
 
-static void FFT(const float *in, float *out, int len, bool inverse) {
-	PFFFT_Setup *setup = pffft_new_setup(len, PFFFT_REAL);
-	float *work = NULL;
-	if (len >= 4096)
-		work = (float*)pffft_aligned_malloc(sizeof(float) * len);
-	pffft_transform_ordered(setup, in, out, work, inverse ? PFFFT_BACKWARD : PFFFT_FORWARD);
-	pffft_destroy_setup(setup);
-	if (work)
-		pffft_aligned_free(work);
+/** pffft setups only hold the twiddle factors for a given length, and are read-only once created.
+So one setup serves both directions and every thread, and is kept for the lifetime of the process.
+*/
+static std::mutex fftSetupsMutex;
+static std::map<std::pair<int, int>, PFFFT_Setup*> fftSetups;
+
+static PFFFT_Setup *getFFTSetup(int len, pffft_transform_t transform) {
+	std::lock_guard<std::mutex> lock(fftSetupsMutex);
+	PFFFT_Setup *&setup = fftSetups[std::make_pair(len, (int) transform)];
+	if (!setup)
+		setup = pffft_new_setup(len, transform);
+	assert(setup);
+	return setup;
+}
+
+
+/** Aligned scratch memory owned by the calling thread, grown as needed and reused by every transform */
+struct FFTScratch {
+	float *data = NULL;
+	int len = 0;
+
+	~FFTScratch() {
+		if (data)
+			pffft_aligned_free(data);
+	}
+
+	float *get(int newLen) {
+		if (newLen > len) {
+			if (data)
+				pffft_aligned_free(data);
+			data = (float*) pffft_aligned_malloc(sizeof(float) * newLen);
+			len = newLen;
+		}
+		return data;
+	}
+};
+
+static thread_local FFTScratch fftScratch;
+/** Used by RDFT(), IRDFT() and cyclicResample() to hold the buffers of the arbitrary length transforms, which call into FFT() and so can't share fftScratch */
+static thread_local FFTScratch dftScratch;
+
+static bool isSIMDAligned(const float *p) {
+	return ((uintptr_t) p % (pffft_simd_size() * sizeof(float))) == 0;
+}
+
+/** Whether pffft can transform `len` points directly.
+It needs a multiple of simd^2 (complex) or 2 simd^2 (real) points with no prime factors other than 2, 3 and 5.
+*/
+static bool isFFTLength(int len, pffft_transform_t transform) {
+	int simd = pffft_simd_size();
+	int multiple = (transform == PFFFT_REAL ? 2 : 1) * simd * simd;
+	if (len <= 0 || len % multiple != 0)
+		return false;
+	for (int factor : {2, 3, 5}) {
+		while (len % factor == 0)
+			len /= factor;
+	}
+	return len == 1;
+}
+
+
+/** Transforms a signal of `n` floats. Complex signals are interleaved, so n is twice their length. */
+static void FFT(PFFFT_Setup *setup, const float *in, float *out, int n, bool inverse) {
+	// Layout: work buffer, aligned input, aligned output
+	float *scratch = fftScratch.get(3 * n);
+	float *work = scratch;
+
+	// pffft needs SIMD-aligned buffers, so stage through scratch memory if the caller's aren't
+	const float *alignedIn = in;
+	if (!isSIMDAligned(in)) {
+		memcpy(scratch + n, in, sizeof(float) * n);
+		alignedIn = scratch + n;
+	}
+	float *alignedOut = isSIMDAligned(out) ? out : scratch + 2 * n;
+
+	pffft_transform_ordered(setup, alignedIn, alignedOut, work, inverse ? PFFFT_BACKWARD : PFFFT_FORWARD);
+
+	if (alignedOut != out)
+		memcpy(out, alignedOut, sizeof(float) * n);
 }
 
 
 void RFFT(const float *in, float *out, int len) {
-	FFT(in, out, len, false);
+	FFT(getFFTSetup(len, PFFFT_REAL), in, out, len, false);
+	dsp.scale(out, 1.0 / len, len);
+}
+
+
+void IRFFT(const float *in, float *out, int len) {
+	FFT(getFFTSetup(len, PFFFT_REAL), in, out, len, true);
+}
+
+
+struct WavePhasors {
+	float data[2 * WAVE_LEN];
+
+	WavePhasors() {
+		for (int m = 0; m < WAVE_LEN; m++) {
+			data[2 * m] = cos(2 * M_PI * m / WAVE_LEN);
+			data[2 * m + 1] = sin(2 * M_PI * m / WAVE_LEN);
+		}
+	}
+};
+
+static const WavePhasors wavePhasorTable;
+
+const float *wavePhasors() {
+	return wavePhasorTable.data;
+}
+
+
+void phasorRamp(float *out, double phase, double step, int len) {
+	// The recurrence is run in double precision, so the error stays far below float resolution for any wave length
+	std::complex<double> z = std::polar(1.0, 2 * M_PI * phase);
+	std::complex<double> s = std::polar(1.0, 2 * M_PI * step);
+	for (int k = 0; k < len; k++) {
+		out[2 * k] = z.real();
+		out[2 * k + 1] = z.imag();
+		z *= s;
+	}
+}
+
+
+/** Bluestein's algorithm turns a DFT of any length into a circular convolution with a chirp, which pffft can do at a power of two length.
+X_k = conj(w_k) sum_n (x_n conj(w_n)) w_(k-n), where w_m = exp(i pi m^2 / len)
+*/
+struct BluesteinPlan {
+	/** Power of two length of the convolution, at least 2 len - 1 */
+	int convLen;
+	PFFFT_Setup *convSetup;
+	/** conj(w_n) for 0 <= n < len, interleaved complex */
+	float *chirp;
+	/** FFT of w wrapped around convLen, scaled by 1 / convLen to normalize the convolution */
+	float *kernel;
+
+	~BluesteinPlan() {
+		pffft_destroy_setup(convSetup);
+		pffft_aligned_free(chirp);
+		pffft_aligned_free(kernel);
+	}
+};
+
+/** Everything needed to transform one length, so repeated transforms skip the setup registries.
+The plan owns its setups, so evicting it frees all of its memory.
+*/
+struct DFTPlan {
+	int len;
+	/** Set if pffft can transform the real signal directly */
+	PFFFT_Setup *realSetup;
+	/** Otherwise the signal is transformed as a complex one, directly or with Bluestein's algorithm */
+	PFFFT_Setup *complexSetup;
+	BluesteinPlan *bluestein;
+	/** Floats of scratch space needed by rdft() and irdft() */
+	int bufferLen;
+
+	~DFTPlan() {
+		if (realSetup)
+			pffft_destroy_setup(realSetup);
+		if (complexSetup)
+			pffft_destroy_setup(complexSetup);
+		delete bluestein;
+	}
+};
+
+/** Plans of imported files with unusual lengths are rarely reused, so only a few recent ones are kept */
+static const size_t dftPlansMax = 16;
+/** Longer plans are built for each call, so importing one long file doesn't hold its plan for the rest of the session */
+static const int dftPlanCacheMaxLen = 16384;
+
+struct DFTPlanEntry {
+	std::shared_ptr<const DFTPlan> plan;
+	uint64_t lastUse;
+};
+
+static std::mutex dftPlansMutex;
+static std::map<int, DFTPlanEntry> dftPlans;
+static uint64_t dftPlansClock = 0;
+
+static BluesteinPlan *newBluesteinPlan(int len) {
+	BluesteinPlan *plan = new BluesteinPlan();
+	plan->convLen = 64;
+	while (plan->convLen < 2 * len - 1)
+		plan->convLen *= 2;
+	plan->convSetup = pffft_new_setup(plan->convLen, PFFFT_COMPLEX);
+	plan->chirp = (float*) pffft_aligned_malloc(sizeof(float) * 2 * len);
+	plan->kernel = (float*) pffft_aligned_malloc(sizeof(float) * 2 * plan->convLen);
+
+	float *w = plan->kernel;
+	memset(w, 0, sizeof(float) * 2 * plan->convLen);
+	for (int n = 0; n < len; n++) {
+		// Reduce n^2 mod 2 len first, so the phase stays accurate for long transforms
+		long long n2 = (long long) n * n % (2 * len);
+		double phase = M_PI * n2 / len;
+		plan->chirp[2 * n] = cos(phase);
+		plan->chirp[2 * n + 1] = -sin(phase);
+		w[2 * n] = cos(phase);
+		w[2 * n + 1] = sin(phase);
+		// Negative indices wrap around
+		if (n > 0) {
+			w[2 * (plan->convLen - n)] = w[2 * n];
+			w[2 * (plan->convLen - n) + 1] = w[2 * n + 1];
+		}
+	}
+	FFT(plan->convSetup, w, plan->kernel, 2 * plan->convLen, false);
+	dsp.scale(plan->kernel, 1.0 / plan->convLen, 2 * plan->convLen);
+	return plan;
+}
+
+static DFTPlan *newDFTPlan(int len) {
+	DFTPlan *plan = new DFTPlan();
+	plan->len = len;
+	if (isFFTLength(len, PFFFT_REAL)) {
+		plan->realSetup = pffft_new_setup(len, PFFFT_REAL);
+		// Room to pack the Nyquist bin for pffft
+		plan->bufferLen = len;
+	}
+	else {
+		// Complex input and output
+		plan->bufferLen = 4 * len;
+		if (isFFTLength(len, PFFFT_COMPLEX)) {
+			plan->complexSetup = pffft_new_setup(len, PFFFT_COMPLEX);
+		}
+		else {
+			plan->bluestein = newBluesteinPlan(len);
+			plan->bufferLen += 2 * plan->bluestein->convLen;
+		}
+	}
+	return plan;
+}
+
+/** Callers hold the returned plan for as long as they use it, since it may be evicted from the cache meanwhile */
+static std::shared_ptr<const DFTPlan> getDFTPlan(int len) {
+	if (len > dftPlanCacheMaxLen)
+		return std::shared_ptr<const DFTPlan>(newDFTPlan(len));
+
+	std::lock_guard<std::mutex> lock(dftPlansMutex);
+	DFTPlanEntry &entry = dftPlans[len];
+	if (!entry.plan)
+		entry.plan.reset(newDFTPlan(len));
+	entry.lastUse = ++dftPlansClock;
+	std::shared_ptr<const DFTPlan> plan = entry.plan;
+
+	// Evict the least recently used plans
+	while (dftPlans.size() > dftPlansMax) {
+		std::map<int, DFTPlanEntry>::iterator oldest = dftPlans.begin();
+		for (std::map<int, DFTPlanEntry>::iterator it = dftPlans.begin(); it != dftPlans.end(); it++) {
+			if (it->second.lastUse < oldest->second.lastUse)
+				oldest = it;
+		}
+		dftPlans.erase(oldest);
+	}
+	return plan;
+}
+
+
+/** Unnormalized forward DFT of `plan->len` interleaved complex numbers.
+`conv` must hold 2 convLen floats if the plan uses Bluestein's algorithm.
+*/
+static void complexDFT(const DFTPlan *plan, const float *in, float *out, float *conv) {
+	int len = plan->len;
+	if (plan->complexSetup) {
+		FFT(plan->complexSetup, in, out, 2 * len, false);
+		return;
+	}
+
+	const BluesteinPlan *bluestein = plan->bluestein;
+	memset(conv, 0, sizeof(float) * 2 * bluestein->convLen);
+	memcpy(conv, in, sizeof(float) * 2 * len);
+	dsp.cmult(conv, bluestein->chirp, len);
+
+	FFT(bluestein->convSetup, conv, conv, 2 * bluestein->convLen, false);
+	dsp.cmult(conv, bluestein->kernel, bluestein->convLen);
+	FFT(bluestein->convSetup, conv, conv, 2 * bluestein->convLen, true);
+
+	dsp.cmult(conv, bluestein->chirp, len);
+	memcpy(out, conv, sizeof(float) * 2 * len);
+}
+
 
+static void rdft(const DFTPlan *plan, const float *in, float *out, float *buffer) {
+	int len = plan->len;
+	int bins = len / 2 + 1;
+	if (plan->realSetup) {
+		FFT(plan->realSetup, in, out, len, false);
+		dsp.scale(out, 1.0 / len, len);
+		// Unpack the Nyquist bin which pffft stores in out[1]
+		float nyquist = out[1];
+		out[1] = 0.0;
+		out[2 * (bins - 1)] = nyquist;
+		out[2 * (bins - 1) + 1] = 0.0;
+		return;
+	}
+
+	float *x = buffer;
+	float *y = buffer + 2 * len;
+	for (int n = 0; n < len; n++) {
+		x[2 * n] = in[n];
+		x[2 * n + 1] = 0.0;
+	}
+	complexDFT(plan, x, y, buffer + 4 * len);
 	float a = 1.0 / len;
-	for (int i = 0; i < len; i++) {
-		out[i] *= a;
+	for (int k = 0; k < bins; k++) {
+		out[2 * k] = y[2 * k] * a;
+		out[2 * k + 1] = y[2 * k + 1] * a;
 	}
 }
 
 
-void IRFFT(const float *in, float *out, int len) {
-	FFT(in, out, len, true);
+static void irdft(const DFTPlan *plan, const float *in, float *out, float *buffer) {
+	int len = plan->len;
+	int bins = len / 2 + 1;
+	if (plan->realSetup) {
+		// Pack the Nyquist bin into x[1] like pffft expects
+		float *x = buffer;
+		memcpy(x, in, sizeof(float) * len);
+		x[1] = in[2 * (bins - 1)];
+		FFT(plan->realSetup, x, out, len, true);
+		return;
+	}
+
+	// The inverse DFT is the conjugate of the forward DFT of the conjugate.
+	// Only the real part is needed, so only the input has to be conjugated.
+	float *x = buffer;
+	float *y = buffer + 2 * len;
+	for (int k = 0; k < len; k++) {
+		// Bins above len / 2 mirror the ones below
+		int mirror = (k < bins) ? k : len - k;
+		float sign = (k < bins) ? -1.0 : 1.0;
+		x[2 * k] = in[2 * mirror];
+		x[2 * k + 1] = sign * in[2 * mirror + 1];
+	}
+	complexDFT(plan, x, y, buffer + 4 * len);
+	for (int n = 0; n < len; n++) {
+		out[n] = y[2 * n];
+	}
+}
+
+
+void RDFT(const float *in, float *out, int len) {
+	std::shared_ptr<const DFTPlan> plan = getDFTPlan(len);
+	rdft(plan.get(), in, out, dftScratch.get(plan->bufferLen));
 }
 
 
-int resample(const float *in, int inLen, float *out, int outLen, double ratio) {
-	SRC_DATA data;
-	// Old versions of libsamplerate don't use const here
-	data.data_in = (float*) in;
-	data.data_out = out;
-	data.input_frames = inLen;
-	data.output_frames = outLen;
-	data.end_of_input = true;
-	data.src_ratio = ratio;
-	src_simple(&data, SRC_SINC_FASTEST, 1);
-	return data.output_frames_gen;
+void IRDFT(const float *in, float *out, int len) {
+	std::shared_ptr<const DFTPlan> plan = getDFTPlan(len);
+	irdft(plan.get(), in, out, dftScratch.get(plan->bufferLen));
 }
 
 
-void cyclicOversample(const float *in, float *out, int len, int oversample) {
-	float x[len * oversample];
-	memset(x, 0, sizeof(x));
-	// Zero-stuff oversampled buffer
-	for (int i = 0; i < len; i++) {
-		x[i * oversample] = in[i] * oversample;
+CyclicResampler::CyclicResampler(int inLen, int outLen) {
+	this->inLen = inLen;
+	this->outLen = outLen;
+	inPlan = getDFTPlan(inLen);
+	outPlan = getDFTPlan(outLen);
+}
+
+
+int CyclicResampler::bufferLen() const {
+	int bins = maxi(inLen, outLen) / 2 + 1;
+	return 2 * bins + maxi(inPlan->bufferLen, outPlan->bufferLen);
+}
+
+
+void CyclicResampler::process(const float *in, float *out, float *buffer) const {
+	float *spectrum = buffer;
+	float *work = buffer + 2 * (maxi(inLen, outLen) / 2 + 1);
+	rdft(inPlan.get(), in, spectrum, work);
+
+	// Only keep harmonics below the Nyquist frequency of both lengths
+	int keep = (mini(inLen, outLen) + 1) / 2;
+	int outBins = outLen / 2 + 1;
+	for (int k = keep; k < outBins; k++) {
+		spectrum[2 * k] = 0.0;
+		spectrum[2 * k + 1] = 0.0;
+	}
+
+	irdft(outPlan.get(), spectrum, out, work);
+}
+
+
+void cyclicResample(const float *in, int inLen, float *out, int outLen) {
+	CyclicResampler resampler(inLen, outLen);
+	resampler.process(in, out, dftScratch.get(resampler.bufferLen()));
+}
+
+
+struct ResampleTier {
+	/** Zero crossings of the sinc on each side of the kernel */
+	int zeros;
+	/** Fractional delays tabulated when not downsampling, linearly interpolated between */
+	int phases;
+	/** Cutoff as a fraction of the lower Nyquist frequency */
+	double bandwidth;
+};
+
+static const ResampleTier resampleTiers[RESAMPLE_QUALITIES_LEN] = {
+	{8, 32, 0.90},
+	{32, 256, 0.95},
+};
+
+/** Blackman windowed sinc lowpass for one resampling ratio, tabulated at `phases` + 1 fractional delays from 0 to 1.
+Filtering an output sample is then a dot product of the two nearest phases with the input.
+*/
+struct PolyphaseFilter {
+	double ratio = 0.0;
+	/** Kernel spans input samples i0 - half + 1 to i0 + half around position i0 + frac */
+	int half = 0;
+	/** Taps per phase, padded with zeros to a multiple of 8 */
+	int taps = 0;
+	int phases = 0;
+	float *coeffs = NULL;
+
+	~PolyphaseFilter() {
+		if (coeffs)
+			pffft_aligned_free(coeffs);
 	}
-	float fft[len * oversample];
-	RFFT(x, fft, len * oversample);
 
-	// Apply brick wall filter
-	// y_{N/2} = 0
-	fft[1] = 0.0;
-	// y_k = 0 for k >= len
-	for (int i = len / 2; i < len * oversample / 2; i++) {
-		fft[2*i] = 0.0;
-		fft[2*i + 1] = 0.0;
+	void build(double newRatio, const ResampleTier &tier) {
+		ratio = newRatio;
+		double cutoff = tier.bandwidth * fmin(ratio, 1.0);
+		// Downsampling widens the kernel by 1 / cutoff, but also lowers the phase resolution needed by the same factor
+		half = ceil(tier.zeros / cutoff);
+		taps = (2 * half + 7) / 8 * 8;
+		phases = maxi(1, ceil(tier.phases * cutoff));
+
+		if (coeffs)
+			pffft_aligned_free(coeffs);
+		coeffs = (float*) pffft_aligned_malloc(sizeof(float) * (phases + 1) * taps);
+		for (int p = 0; p <= phases; p++) {
+			double frac = (double) p / phases;
+			for (int k = 0; k < taps; k++) {
+				// Distance from the output position to the input sample
+				double t = k - half + 1 - frac;
+				double h = 0.0;
+				if (k < 2 * half) {
+					double x = M_PI * cutoff * t;
+					double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(x) / x;
+					double window = 0.42 + 0.5 * cos(M_PI * t / half) + 0.08 * cos(2 * M_PI * t / half);
+					h = cutoff * sinc * window;
+				}
+				coeffs[p * taps + k] = h;
+			}
+		}
 	}
+};
+
+
+int resample(const float *in, int inLen, float *out, int outLen, double ratio, ResampleQuality quality) {
+	// Keep the last filter of each tier, since the import page resamples at the same ratio every frame
+	static thread_local PolyphaseFilter filters[RESAMPLE_QUALITIES_LEN];
+	PolyphaseFilter &filter = filters[quality];
+	if (filter.ratio != ratio)
+		filter.build(ratio, resampleTiers[quality]);
+
+	int count = clampi(round(inLen * ratio), 0, outLen);
+	for (int j = 0; j < count; j++) {
+		double pos = j / ratio;
+		int i0 = floor(pos);
+		float phase = (pos - i0) * filter.phases;
+		int p = mini(phase, filter.phases - 1);
+		float pFrac = phase - p;
+		const float *h0 = &filter.coeffs[p * filter.taps];
+		const float *h1 = h0 + filter.taps;
+		int start = i0 - filter.half + 1;
 
-	IRFFT(fft, out, len * oversample);
+		if (start >= 0 && start + filter.taps <= inLen) {
+			out[j] = crossf(dsp.dot(h0, &in[start], filter.taps), dsp.dot(h1, &in[start], filter.taps), pFrac);
+		}
+		else {
+			// Treat samples past the edges as silence
+			float sum0 = 0.0;
+			float sum1 = 0.0;
+			int kMin = maxi(0, -start);
+			int kMax = mini(2 * filter.half, inLen - start);
+			for (int k = kMin; k < kMax; k++) {
+				sum0 += h0[k] * in[start + k];
+				sum1 += h1[k] * in[start + k];
+			}
+			out[j] = crossf(sum0, sum1, pFrac);
+		}
+	}
+	return count;
 }
 
 
+const char *ditherNames[DITHER_LEN] = {
+	"None",
+	"TPDF",
+	"Noise Shaped",
+};
+
+Dither exportDither = DITHER_NONE;
+
+
 void i16_to_f32(const int16_t *in, float *out, int length) {
-	for (int i = 0; i < length; i++) {
-		out[i] = in[i] / 32767.f;
-	}
+	dsp.i16ToF32(in, out, length);
 }
-void f32_to_i16(const float *in, int16_t *out, int length) {
-	for (int i = 0; i < length; i++) {
+void f32_to_i16(const float *in, int16_t *out, int length, Dither dither, uint32_t seed) {
+	if (dither == DITHER_SHAPED) {
+		// Second order error feedback, so the output noise is shaped by (1 - z^-1)^2
+		float e1 = 0.0;
+		float e2 = 0.0;
+		for (int i = 0; i < length; i++) {
+			float v = in[i] * 32767.f - 2.0 * e1 + e2;
+			float q = roundf(v + tpdff(seed + i));
+			e2 = e1;
+			// Use the error before clipping, otherwise the feedback runs away on loud signals
+			e1 = q - v;
+			out[i] = clampf(q, -32767.f, 32767.f);
+		}
+	}
+	else {
 		// The following line has an incredible amount of controversy among DSP enthusiasts.
-		out[i] = roundf(clampf(in[i], -1.0, 1.0) * 32767.f);
+		// The noise only depends on the sample index, so converting the same samples twice gives the same result.
+		dsp.f32ToI16(in, out, length, dither == DITHER_TPDF ? 1.0 : 0.0, seed);
 	}
 }
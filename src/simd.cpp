@@ -0,0 +1,149 @@
+#include "WaveEdit.hpp"
+#include "fastmath.hpp"
+#include <string.h>
+#include <strings.h>
+#include <float.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define SIMD_X86
+#elif defined(__aarch64__)
+	#define SIMD_ARM
+#endif
+
+
+const char *simdLevelNames[SIMD_LEVELS_LEN] = {
+	"scalar",
+	"sse2",
+	"avx2",
+	"avx512",
+	"neon",
+};
+
+
+#define DSP_CONCAT2(a, b) a##_##b
+#define DSP_CONCAT(a, b) DSP_CONCAT2(a, b)
+#define DSP_NAME(name) DSP_CONCAT(name, DSP_SUFFIX)
+
+// Scalar kernels are the reference, so keep GCC from vectorizing them
+#define DSP_SUFFIX scalar
+#if defined(__GNUC__) && !defined(__clang__)
+	#define DSP_TARGET __attribute__((optimize("no-tree-vectorize")))
+#else
+	#define DSP_TARGET
+#endif
+#include "dspkernels.hpp"
+#undef DSP_SUFFIX
+#undef DSP_TARGET
+
+#if defined(SIMD_X86)
+	#define DSP_SUFFIX sse2
+	#define DSP_TARGET __attribute__((target("sse2")))
+	#include "dspkernels.hpp"
+	#undef DSP_SUFFIX
+	#undef DSP_TARGET
+
+	#define DSP_SUFFIX avx2
+	#define DSP_TARGET __attribute__((target("avx2,fma")))
+	#include "dspkernels.hpp"
+	#undef DSP_SUFFIX
+	#undef DSP_TARGET
+
+	#define DSP_SUFFIX avx512
+	#define DSP_TARGET __attribute__((target("avx512f")))
+	#include "dspkernels.hpp"
+	#undef DSP_SUFFIX
+	#undef DSP_TARGET
+#elif defined(SIMD_ARM)
+	// NEON is part of the AArch64 baseline, so no target attribute is needed
+	#define DSP_SUFFIX neon
+	#define DSP_TARGET
+	#include "dspkernels.hpp"
+	#undef DSP_SUFFIX
+	#undef DSP_TARGET
+#endif
+
+
+#define DSP_KERNELS(suffix) { \
+	scale_##suffix, \
+	cmult_##suffix, \
+	norm_##suffix, \
+	rampMinMax_##suffix, \
+	rampClamp_##suffix, \
+	chebyshev_##suffix, \
+	dot_##suffix, \
+	i16ToF32_##suffix, \
+	f32ToI16_##suffix, \
+}
+
+// Usable before simdInit() is called
+DSPKernels dsp = DSP_KERNELS(scalar);
+static SIMDLevel simdLevel = SIMD_SCALAR;
+
+
+static bool simdSupported(SIMDLevel level) {
+	switch (level) {
+		case SIMD_SCALAR: return true;
+#if defined(SIMD_X86)
+		case SIMD_SSE2: return __builtin_cpu_supports("sse2");
+		case SIMD_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		case SIMD_AVX512: return __builtin_cpu_supports("avx512f");
+#elif defined(SIMD_ARM)
+		case SIMD_NEON: return true;
+#endif
+		default: return false;
+	}
+}
+
+
+bool simdSetLevel(SIMDLevel level) {
+	if (!simdSupported(level))
+		return false;
+
+	switch (level) {
+		case SIMD_SCALAR: dsp = DSP_KERNELS(scalar); break;
+#if defined(SIMD_X86)
+		case SIMD_SSE2: dsp = DSP_KERNELS(sse2); break;
+		case SIMD_AVX2: dsp = DSP_KERNELS(avx2); break;
+		case SIMD_AVX512: dsp = DSP_KERNELS(avx512); break;
+#elif defined(SIMD_ARM)
+		case SIMD_NEON: dsp = DSP_KERNELS(neon); break;
+#endif
+		default: return false;
+	}
+	simdLevel = level;
+	return true;
+}
+
+
+SIMDLevel simdGetLevel() {
+	return simdLevel;
+}
+
+
+void simdInit() {
+#if defined(SIMD_X86)
+	__builtin_cpu_init();
+#endif
+
+	// Allow forcing a level, e.g. OXIWAVE_SIMD=scalar, to compare results between kernels
+	bool forced = false;
+	const char *forcedName = getenv("OXIWAVE_SIMD");
+	if (forcedName) {
+		for (int level = 0; level < SIMD_LEVELS_LEN; level++) {
+			if (strcasecmp(forcedName, simdLevelNames[level]) == 0)
+				forced = simdSetLevel((SIMDLevel) level);
+		}
+		if (!forced)
+			printf("SIMD level %s is not available, ignoring OXIWAVE_SIMD\n", forcedName);
+	}
+
+	if (!forced) {
+		// Pick the widest supported level
+		for (int level = SIMD_LEVELS_LEN - 1; level >= 0; level--) {
+			if (simdSetLevel((SIMDLevel) level))
+				break;
+		}
+	}
+
+	printf("Using %s DSP kernels\n", simdLevelNames[simdLevel]);
+}
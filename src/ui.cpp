@@ -7,6 +7,7 @@
 	#include <sys/syslimits.h>
 #endif
 #include <libgen.h>
+#include <memory>
 
 #include <SDL.h>
 #include <SDL_opengl.h>
@@ -183,11 +184,23 @@ static void menuOpenSphereOLD() {
 	free(dir);
 }
 
+/** Writes a copy of the current bank on the I/O thread, so editing continues while a slow disk is written.
+The dither is copied too, since the menu can change it before the save runs.
+*/
+static void saveBankInBackground(bool (Bank::*save)(const char*, Dither), const char *path) {
+	std::shared_ptr<Bank> bank = std::make_shared<Bank>(currentBank);
+	std::string filename = path;
+	Dither dither = exportDither;
+	ioRun(path, [bank, save, filename, dither] {
+		return ((*bank).*save)(filename.c_str(), dither);
+	});
+}
+
 static void menuSaveSphereAs() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled Wavetable.wav", NULL);
 	if (path) {
-		currentBank.exportMultiWAVs(path);
+		saveBankInBackground(&Bank::exportMultiWAVs, path);
 		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 		free(path);
 	}
@@ -196,7 +209,7 @@ static void menuSaveSphereAs() {
 
 static void menuSaveSphere() {
 	if (str_ends_with(lastFilename, ".wav")) 
-		currentBank.exportMultiWAVs(lastFilename);
+		saveBankInBackground(&Bank::exportMultiWAVs, lastFilename);
 	else
 		menuSaveSphereAs();
 }
@@ -205,7 +218,7 @@ static void menuSaveWaves() {
 	char *dir = getLastDir();
 	char *path = osdialog_file(OSDIALOG_OPEN_DIR, dir, NULL, NULL);
 	if (path) {
-		currentBank.saveWaves(path);
+		saveBankInBackground(&Bank::saveWaves, path);
 		snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 		free(path);
 	}
@@ -258,7 +271,7 @@ static void menuClear() {
 
 static void menuRandomize() {
 	for (int i = mini(selectedId, lastSelectedId); i <= maxi(selectedId, lastSelectedId); i++) {
-		currentBank.waves[i].randomizeEffects();
+		currentBank.waves[i].randomizeEffects(currentBank.chain);
 	}
 	historyPush();
 }
@@ -410,7 +423,7 @@ void renderWaveMenu() {
 		char *dir = getLastDir();
 		char *path = osdialog_file(OSDIALOG_OPEN, dir, NULL, NULL);
 		if (path) {
-			currentBank.waves[selectedId].loadWAV(path);
+			currentBank.waves[selectedId].loadWAV(path, currentBank.chain);
 			historyPush();
 			snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 			free(path);
@@ -421,7 +434,12 @@ void renderWaveMenu() {
 		char *dir = getLastDir();
 		char *path = osdialog_file(OSDIALOG_SAVE, dir, "Untitled.wav", NULL);
 		if (path) {
-			currentBank.waves[selectedId].saveWAV(path);
+			std::shared_ptr<Wave> wave = std::make_shared<Wave>(currentBank.waves[selectedId]);
+			std::string filename = path;
+			Dither dither = exportDither;
+			ioRun(path, [wave, filename, dither] {
+				return wave->saveWAV(filename.c_str(), dither);
+			});
 			snprintf(lastFilename, sizeof(lastFilename), "%s", path);
 			free(path);
 		}
@@ -475,6 +493,13 @@ void renderMenu() {
 				menuSaveWaves();
 			if (ImGui::MenuItem("Load Waves from Folder...", NULL))
 				menuLoadWaves();
+			if (ImGui::BeginMenu("Export Dither")) {
+				for (int i = 0; i < DITHER_LEN; i++) {
+					if (ImGui::MenuItem(ditherNames[i], NULL, exportDither == i))
+						exportDither = (Dither) i;
+				}
+				ImGui::EndMenu();
+			}
 
 			ImGui::MenuItem("##spacer", NULL, false, false);
 			if (ImGui::MenuItem("Quit", ImGui::GetIO().OSXBehaviors ? "Cmd+Q" : "Ctrl+Q"))
@@ -488,6 +513,34 @@ void renderMenu() {
 				historyUndo();
 			if (ImGui::MenuItem("Redo", ImGui::GetIO().OSXBehaviors ? "Cmd+Shift+Z" : "Ctrl+Shift+Z"))
 				historyRedo();
+			if (ImGui::BeginMenu("History Budget")) {
+				static const int budgetsMB[] = {4, 16, 64, 256};
+				for (int budgetMB : budgetsMB) {
+					char label[32];
+					snprintf(label, sizeof(label), "%d MB", budgetMB);
+					size_t budget = (size_t) budgetMB << 20;
+					if (ImGui::MenuItem(label, NULL, historyGetBudget() == budget))
+						historySetBudget(budget);
+				}
+				ImGui::EndMenu();
+			}
+			char historyText[64];
+			snprintf(historyText, sizeof(historyText), "(History: %.1f MB in memory, %.1f MB on disk)", historyGetMemoryUsage() / 1048576.0, historyGetDiskUsage() / 1048576.0);
+			ImGui::MenuItem(historyText, NULL, false, false);
+			if (ImGui::BeginMenu("Effect Cache Budget")) {
+				static const int budgetsMB[] = {0, 1, 4, 16};
+				for (int budgetMB : budgetsMB) {
+					char label[32];
+					snprintf(label, sizeof(label), budgetMB > 0 ? "%d MB" : "Off", budgetMB);
+					size_t budget = (size_t) budgetMB << 20;
+					if (ImGui::MenuItem(label, NULL, effectCacheGetBudget() == budget))
+						effectCacheSetBudget(budget);
+				}
+				ImGui::EndMenu();
+			}
+			char effectCacheText[64];
+			snprintf(effectCacheText, sizeof(effectCacheText), "(Effect cache: %.1f MB)", effectCacheGetUsage() / 1048576.0);
+			ImGui::MenuItem(effectCacheText, NULL, false, false);
 			if (ImGui::MenuItem("Select All", ImGui::GetIO().OSXBehaviors ? "Cmd+A" : "Ctrl+A"))
 				menuSelectAll();
 			ImGui::MenuItem("##spacer", NULL, false, false);
@@ -526,6 +579,9 @@ void renderMenu() {
 			// if (ImGui::MenuItem("imgui Demo", NULL, showTestWindow)) showTestWindow = !showTestWindow;
 			ImGui::EndMenu();
 		}
+		std::string ioStatus = ioGetStatus();
+		if (!ioStatus.empty())
+			ImGui::MenuItem(ioStatus.c_str(), NULL, false, false);
 		ImGui::EndMenuBar();
 	}
 }
@@ -593,8 +649,7 @@ void effectSlider(EffectID effect) {
 	char text[64];
 	snprintf(text, sizeof(text), "%s: %%.3f", effectNames[effect]);
 	if (ImGui::SliderFloat(id, &currentBank.waves[selectedId].effects[effect], 0.0f, 1.0f, text)) {
-		currentBank.waves[selectedId].updatePost();
-		historyPush();
+		historyTouch(selectedId);
 	}
 }
 
@@ -641,7 +696,7 @@ void editorPage() {
 				for (const CatalogFile &catalogFile : catalogCategory.files) {
 					if (ImGui::Selectable(catalogFile.name.c_str())) {
 						memcpy(currentBank.waves[selectedId].samples, catalogFile.samples, sizeof(float) * WAVE_LEN);
-						currentBank.waves[selectedId].commitSamples();
+						currentBank.waves[selectedId].commitSamples(currentBank.chain);
 						historyPush();
 					}
 				}
@@ -660,16 +715,18 @@ void editorPage() {
 
 			ImGui::Text("Waveform");
 			const int oversample = 4;
+			static CyclicResampler oversampler(WAVE_LEN, WAVE_LEN * oversample);
+			static std::vector<float> oversampleBuffer(oversampler.bufferLen());
 			float waveOversample[WAVE_LEN * oversample];
-			cyclicOversample(wave->postSamples, waveOversample, WAVE_LEN, oversample);
+			oversampler.process(wave->postSamples, waveOversample, oversampleBuffer.data());
 			if (renderWave("WaveEditor", 200.0, wave->samples, WAVE_LEN, waveOversample, WAVE_LEN * oversample, tool)) {
-				currentBank.waves[selectedId].commitSamples();
+				currentBank.waves[selectedId].commitSamples(currentBank.chain);
 				historyPush();
 			}
 
 			ImGui::Text("Harmonics");
-			if (renderHistogram("HarmonicEditor", 200.0, wave->harmonics, WAVE_LEN / 2, wave->postHarmonics, WAVE_LEN / 2, tool)) {
-				currentBank.waves[selectedId].commitHarmonics();
+			if (renderHistogram("HarmonicEditor", 200.0, wave->getHarmonics(), WAVE_LEN / 2, wave->getPostHarmonics(), WAVE_LEN / 2, tool)) {
+				currentBank.waves[selectedId].commitHarmonics(currentBank.chain);
 				historyPush();
 			}
 
@@ -679,27 +736,25 @@ void editorPage() {
 			}
 
 			if (ImGui::Checkbox("Cycle", &currentBank.waves[selectedId].cycle)) {
-				currentBank.waves[selectedId].updatePost();
-				historyPush();
+				historyTouch(selectedId);
 			}
 			ImGui::SameLine();
 			if (ImGui::Checkbox("Normalize", &currentBank.waves[selectedId].normalize)) {
-				currentBank.waves[selectedId].updatePost();
-				historyPush();
+				historyTouch(selectedId);
 			}
 			ImGui::SameLine();
 			if (ImGui::Button("Randomize")) {
-				currentBank.waves[selectedId].randomizeEffects();
+				currentBank.waves[selectedId].randomizeEffects(currentBank.chain);
 				historyPush();
 			}
 			ImGui::SameLine();
 			if (ImGui::Button("Reset")) {
-				currentBank.waves[selectedId].clearEffects();
+				currentBank.waves[selectedId].clearEffects(currentBank.chain);
 				historyPush();
 			}
 			ImGui::SameLine();
 			if (ImGui::Button("Bake")) {
-				currentBank.waves[selectedId].bakeEffects();
+				currentBank.waves[selectedId].bakeEffects(currentBank.chain);
 				historyPush();
 			}
 
@@ -737,8 +792,7 @@ void effectHistogram(EffectID effect, Tool tool) {
 			else {
 				currentBank.waves[i].effects[effect] = average;
 			}
-			currentBank.waves[i].updatePost();
-			historyPush();
+			historyTouch(i);
 		}
 	}
 
@@ -748,14 +802,94 @@ void effectHistogram(EffectID effect, Tool tool) {
 				// TODO This always selects the highest index. Select the index the mouse is hovering (requires renderHistogram() to return an int)
 				selectWave(i);
 				currentBank.waves[i].effects[effect] = value[i];
-				currentBank.waves[i].updatePost();
-				historyPush();
+				historyTouch(i);
 			}
 		}
 	}
 }
 
 
+/** Lists the stages of the bank's effect chain, which can be reordered, disabled, removed and added */
+void effectChainEditor() {
+	EffectChain *chain = &currentBank.chain;
+	ImGui::Text("Effect Chain");
+
+	// Apply reordering after the list is drawn, so the rows don't shift while drawing
+	int moveFrom = -1;
+	int moveTo = -1;
+	int removeIndex = -1;
+	bool edited = false;
+	for (int i = 0; i < chain->len; i++) {
+		ImGui::PushID(i);
+		if (ImGui::Checkbox("##enabled", &chain->enabled[i]))
+			edited = true;
+		ImGui::SameLine();
+		if (ImGui::SmallButton("Up") && i > 0) {
+			moveFrom = i;
+			moveTo = i - 1;
+		}
+		ImGui::SameLine();
+		if (ImGui::SmallButton("Down") && i < chain->len - 1) {
+			moveFrom = i;
+			moveTo = i + 1;
+		}
+		ImGui::SameLine();
+		if (ImGui::SmallButton("Remove"))
+			removeIndex = i;
+		ImGui::SameLine();
+		ImGui::Text("%d. %s", i + 1, effectStageNames[chain->stages[i]]);
+		ImGui::PopID();
+	}
+	if (moveFrom >= 0) {
+		chain->move(moveFrom, moveTo);
+		edited = true;
+	}
+	if (removeIndex >= 0) {
+		chain->remove(removeIndex);
+		edited = true;
+	}
+
+	static int newStage = 0;
+	ImGui::PushItemWidth(200);
+	ImGui::Combo("##newStage", &newStage, effectStageNames, EFFECT_STAGES_LEN);
+	ImGui::PopItemWidth();
+	ImGui::SameLine();
+	if (ImGui::Button("Add Stage") && chain->len < EFFECT_CHAIN_LEN) {
+		chain->append((EffectStageID) newStage);
+		edited = true;
+	}
+	ImGui::SameLine();
+	if (ImGui::Button("Reset Chain")) {
+		int oversample = chain->oversample;
+		chain->reset();
+		chain->oversample = oversample;
+		edited = true;
+	}
+
+	// Oversampling of the nonlinear stages
+	ImGui::Text("Oversampling:");
+	static const int oversampleFactors[] = {1, 2, 4, 8};
+	for (int factor : oversampleFactors) {
+		char label[16];
+		snprintf(label, sizeof(label), "%dx", factor);
+		ImGui::SameLine();
+		if (ImGui::RadioButton(label, chain->oversample == factor)) {
+			chain->oversample = factor;
+			edited = true;
+		}
+	}
+	ImGui::SameLine();
+	double cost = effectChainGetCost();
+	ImGui::Text("Effect chain: %.0f us per wave, %.1f ms per bank on one thread", cost * 1e6, cost * BANK_LEN * 1e3);
+
+	// The chain applies to every wave
+	if (edited) {
+		currentBank.updateAllPost();
+		historyPush();
+	}
+}
+
+
 void effectPage() {
 	static Tool tool = PENCIL_TOOL;
 	renderToolSelector(&tool);
@@ -771,55 +905,54 @@ void effectPage() {
 		if (ImGui::Button("Cycle All")) {
 			for (int i = 0; i < BANK_LEN; i++) {
 				currentBank.waves[i].cycle = true;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				historyTouch(i);
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Cycle None")) {
 			for (int i = 0; i < BANK_LEN; i++) {
 				currentBank.waves[i].cycle = false;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				historyTouch(i);
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Normalize All")) {
 			for (int i = 0; i < BANK_LEN; i++) {
 				currentBank.waves[i].normalize = true;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				historyTouch(i);
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Normalize None")) {
 			for (int i = 0; i < BANK_LEN; i++) {
 				currentBank.waves[i].normalize = false;
-				currentBank.waves[i].updatePost();
-				historyPush();
+				historyTouch(i);
 			}
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Randomize")) {
+			// Serial, since rand() isn't thread safe on every platform
 			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].randomizeEffects();
-				historyPush();
+				currentBank.waves[i].randomizeEffects(currentBank.chain);
 			}
+			historyPush();
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Reset")) {
-			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].clearEffects();
-				historyPush();
-			}
+			parallelFor(BANK_LEN, [](int i) {
+				currentBank.waves[i].clearEffects(currentBank.chain);
+			});
+			historyPush();
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Bake")) {
-			for (int i = 0; i < BANK_LEN; i++) {
-				currentBank.waves[i].bakeEffects();
-				historyPush();
-			}
+			parallelFor(BANK_LEN, [](int i) {
+				currentBank.waves[i].bakeEffects(currentBank.chain);
+			});
+			historyPush();
 		}
+
+		effectChainEditor();
 	}
 	ImGui::EndChild();
 }
@@ -1276,5 +1409,13 @@ void uiDestroy() {
 
 
 void uiRender() {
+	// Each gesture, from mouse down to mouse up, is recorded as one undo step
+	if (ImGui::IsMouseDown(0))
+		historyBegin();
 	renderMain();
+	// Recompute the waves edited this frame together, rather than once per edit
+	historyUpdate();
+	if (!ImGui::IsMouseDown(0))
+		historyCommit();
+	audioSyncBank();
 }
@@ -111,6 +111,16 @@ bool str_ends_with(char *str, const char *ending) {
 }
 
 
+uint32_t fnv1a(const void *data, size_t len, uint32_t h) {
+	const uint8_t *bytes = (const uint8_t*) data;
+	for (size_t i = 0; i < len; i++) {
+		h ^= bytes[i];
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+
 /* This base64 implementation:
 *
 * Copyright (c) 2005-2011, Jouni Malinen <j@w1.fi>
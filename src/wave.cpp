@@ -1,6 +1,11 @@
 #include "WaveEdit.hpp"
+#include "fastmath.hpp"
 #include <string.h>
 #include <sndfile.h>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 
 static Wave clipboardWave = {};
@@ -27,200 +32,649 @@ void Wave::clear() {
 	memset(this, 0, sizeof(Wave));
 }
 
-void Wave::updatePost() {
-	float out[WAVE_LEN];
-	memcpy(out, samples, sizeof(float) * WAVE_LEN);
 
-	// Pre-gain
-	if (effects[PRE_GAIN]) {
-		float gain = powf(20.0, effects[PRE_GAIN]);
-		for (int i = 0; i < WAVE_LEN; i++) {
-			out[i] *= gain;
-		}
+/** Returns the Fourier kernel of the comb filter, with taps at positions `comb * j` and exponentially decreasing amplitude.
+The taps form a geometric series, so each bin is (1 - base) (1 - (base z)^taps) / (1 - base z) with z = exp(-2 pi i k comb).
+The kernel for the last `comb` is kept, since committing a bank usually filters every wave with the same setting.
+*/
+static const float *combKernel(float comb) {
+	const double base = 0.75;
+	const int taps = 40;
+	static thread_local float kernel[WAVE_LEN];
+	static thread_local float kernelComb = -1.0;
+	if (comb == kernelComb)
+		return kernel;
+
+	// z^k and z^(taps k)
+	float z[WAVE_LEN];
+	float zN[WAVE_LEN];
+	phasorRamp(z, 0.0, -comb, WAVE_LEN / 2);
+	phasorRamp(zN, 0.0, -comb * taps, WAVE_LEN / 2);
+
+	double baseN = pow(base, taps);
+	for (int k = 0; k < WAVE_LEN / 2; k++) {
+		std::complex<double> bz = base * std::complex<double>(z[2 * k], z[2 * k + 1]);
+		std::complex<double> bzN = baseN * std::complex<double>(zN[2 * k], zN[2 * k + 1]);
+		// Normalize by sum of geometric series
+		std::complex<double> h = (1.0 - base) * (1.0 - bzN) / (1.0 - bz);
+		kernel[2 * k] = h.real();
+		kernel[2 * k + 1] = h.imag();
 	}
+	kernelComb = comb;
+	return kernel;
+}
 
-	// Temporal and Harmonic Shift
-	if (effects[PHASE_SHIFT] > 0.0 || effects[HARMONIC_SHIFT] > 0.0) {
-		// Shift Fourier phase proportionally
-		float tmp[WAVE_LEN];
-		RFFT(out, tmp, WAVE_LEN);
-		for (int k = 0; k < WAVE_LEN / 2; k++) {
-			float phase = clampf(effects[HARMONIC_SHIFT], 0.0, 1.0) + clampf(effects[PHASE_SHIFT], 0.0, 1.0) * k;
-			float br = cosf(2 * M_PI * phase);
-			float bi = -sinf(2 * M_PI * phase);
-			cmultf(&tmp[2 * k], &tmp[2 * k + 1], tmp[2 * k], tmp[2 * k + 1], br, bi);
-		}
-		IRFFT(tmp, out, WAVE_LEN);
+/** Everything the post arrays are computed from */
+struct PostKey {
+	float samples[WAVE_LEN];
+	float effects[EFFECTS_LEN];
+	EffectChain chain;
+	bool cycle;
+	bool normalize;
+
+	void set(const Wave *wave, const EffectChain &waveChain) {
+		// Zero the padding too, so keys can be compared with memcmp
+		memset(this, 0, sizeof(PostKey));
+		memcpy(samples, wave->samples, sizeof(samples));
+		memcpy(effects, wave->effects, sizeof(effects));
+		chain = waveChain;
+		cycle = wave->cycle;
+		normalize = wave->normalize;
 	}
 
-	// Comb filter
-	if (effects[COMB] > 0.0) {
-		const float base = 0.75;
-		const int taps = 40;
-
-		// Build the kernel in Fourier space
-		// Place taps at positions `comb * j`, with exponentially decreasing amplitude
-		float kernel[WAVE_LEN] = {};
-		for (int k = 0; k < WAVE_LEN / 2; k++) {
-			for (int j = 0; j < taps; j++) {
-				float amplitude = powf(base, j);
-				// Normalize by sum of geometric series
-				amplitude *= (1.0 - base);
-				float phase = -2.0 * M_PI * k * effects[COMB] * j;
-				kernel[2 * k] += amplitude * cosf(phase);
-				kernel[2 * k + 1] += amplitude * sinf(phase);
-			}
+	uint64_t hash() const {
+		// FNV-1a over 32 bit words
+		uint32_t words[sizeof(PostKey) / sizeof(uint32_t)];
+		memcpy(words, this, sizeof(words));
+		uint64_t h = 0xcbf29ce484222325;
+		for (uint32_t word : words) {
+			h ^= word;
+			h *= 0x100000001b3;
 		}
+		return h;
+	}
+};
 
-		// Convolve FFT of input with kernel
-		float fft[WAVE_LEN];
-		RFFT(out, fft, WAVE_LEN);
-		for (int k = 0; k < WAVE_LEN / 2; k++) {
-			cmultf(&fft[2 * k], &fft[2 * k + 1], fft[2 * k], fft[2 * k + 1], kernel[2 * k], kernel[2 * k + 1]);
-		}
-		IRFFT(fft, out, WAVE_LEN);
+/** postSamples of recently computed waves by content, so identical waves, like duplicates or states returned to by undo, only run the effect chain once */
+struct PostMemo {
+	uint64_t hash;
+	PostKey key;
+	float postSamples[WAVE_LEN];
+	uint64_t lastUse;
+};
+
+static const int postMemosLen = 64;
+static std::mutex postMemosMutex;
+static PostMemo postMemos[postMemosLen];
+static uint64_t postMemosClock = 0;
+
+/** Copies the memoized postSamples to the wave */
+static bool postMemoGet(Wave *wave, const PostKey &key, uint64_t hash) {
+	std::lock_guard<std::mutex> lock(postMemosMutex);
+	for (PostMemo &memo : postMemos) {
+		if (memo.lastUse == 0 || memo.hash != hash)
+			continue;
+		if (memcmp(&memo.key, &key, sizeof(PostKey)) != 0)
+			continue;
+		memcpy(wave->postSamples, memo.postSamples, sizeof(memo.postSamples));
+		memo.lastUse = ++postMemosClock;
+		return true;
 	}
+	return false;
+}
 
-	// Ring modulation
-	if (effects[RING] > 0.0) {
-		float ring = ceilf(powf(effects[RING], 2) * (WAVE_LEN / 2 - 2));
-		for (int i = 0; i < WAVE_LEN; i++) {
-			float phase = (float)i / WAVE_LEN * ring;
-			out[i] *= sinf(2 * M_PI * phase);
+static void postMemoSet(const Wave *wave, const PostKey &key, uint64_t hash) {
+	std::lock_guard<std::mutex> lock(postMemosMutex);
+	// Replace the entry for this key, or the least recently used one
+	PostMemo *target = &postMemos[0];
+	for (PostMemo &memo : postMemos) {
+		if (memo.lastUse != 0 && memo.hash == hash && memcmp(&memo.key, &key, sizeof(PostKey)) == 0) {
+			target = &memo;
+			break;
 		}
+		if (memo.lastUse < target->lastUse)
+			target = &memo;
 	}
+	target->hash = hash;
+	target->key = key;
+	memcpy(target->postSamples, wave->postSamples, sizeof(target->postSamples));
+	target->lastUse = ++postMemosClock;
+}
 
-	// Chebyshev waveshaping
-	if (effects[CHEBYSHEV] > 0.0) {
-		float n = powf(50.0, effects[CHEBYSHEV]);
-		for (int i = 0; i < WAVE_LEN; i++) {
-			// Apply a distant variant of the Chebyshev polynomial of the first kind
-			if (-1.0 <= out[i] && out[i] <= 1.0)
-				out[i] = sinf(n * asinf(out[i]));
-			else
-				out[i] = sinf(n * asinf(1.0 / out[i]));
-		}
+
+void Wave::updateSpectrum() {
+	if (spectrumValid)
+		return;
+	// Convert wave to spectrum
+	RFFT(samples, spectrum, WAVE_LEN);
+	// Convert spectrum to harmonics
+	dsp.norm(spectrum, harmonics, WAVE_LEN / 2);
+	spectrumValid = true;
+}
+
+void Wave::updatePostSpectrum() {
+	if (postSpectrumValid)
+		return;
+	RFFT(postSamples, postSpectrum, WAVE_LEN);
+	dsp.norm(postSpectrum, postHarmonics, WAVE_LEN / 2);
+	postSpectrumValid = true;
+}
+
+float *Wave::getHarmonics() {
+	updateSpectrum();
+	return harmonics;
+}
+
+const float *Wave::getPostHarmonics() {
+	updatePostSpectrum();
+	return postHarmonics;
+}
+
+static bool preGainActive(const float *effects) {
+	return effects[PRE_GAIN];
+}
+
+static void preGain(const float *effects, float *x, int len) {
+	float gain = fastpowf(20.0, effects[PRE_GAIN]);
+	dsp.scale(x, gain, len);
+}
+
+static bool shiftActive(const float *effects) {
+	return effects[PHASE_SHIFT] > 0.0 || effects[HARMONIC_SHIFT] > 0.0;
+}
+
+/** Temporal and harmonic shift */
+static void shift(const float *effects, float *fft, int len) {
+	// Shift Fourier phase proportionally
+	// Rotate bin k by -(harmonic + phase k) cycles
+	float rotation[WAVE_LEN];
+	phasorRamp(rotation, -clampf(effects[HARMONIC_SHIFT], 0.0, 1.0), -clampf(effects[PHASE_SHIFT], 0.0, 1.0), WAVE_LEN / 2);
+	dsp.cmult(fft, rotation, WAVE_LEN / 2);
+}
+
+static bool combActive(const float *effects) {
+	return effects[COMB] > 0.0;
+}
+
+static void comb(const float *effects, float *fft, int len) {
+	// Convolve FFT of input with kernel
+	dsp.cmult(fft, combKernel(effects[COMB]), WAVE_LEN / 2);
+}
+
+static bool ringActive(const float *effects) {
+	return effects[RING] > 0.0;
+}
+
+static void ring(const float *effects, float *x, int len) {
+	// The carrier is a whole harmonic, so its phase is always a multiple of 1 / WAVE_LEN
+	int ring = ceilf(powf(effects[RING], 2) * (WAVE_LEN / 2 - 2));
+	const float *phasors = wavePhasors();
+	for (int i = 0, m = 0; i < WAVE_LEN; i++, m = (m + ring) % WAVE_LEN) {
+		x[i] *= phasors[2 * m + 1];
 	}
+}
 
-	// Sample & Hold
-	if (effects[SAMPLE_AND_HOLD] > 0.0) {
-		float frameskip = powf(WAVE_LEN / 2.0, clampf(effects[SAMPLE_AND_HOLD], 0.0, 1.0));
-		float tmp[WAVE_LEN + 1];
-		memcpy(tmp, out, sizeof(float) * WAVE_LEN);
-		tmp[WAVE_LEN] = tmp[0];
-
-		// Dumb linear interpolation S&H
-		for (int i = 0; i < WAVE_LEN; i++) {
-			float index = roundf(i / frameskip) * frameskip;
-			out[i] = linterpf(tmp, clampf(index, 0.0, WAVE_LEN - 1));
-		}
+static bool chebyshevActive(const float *effects) {
+	return effects[CHEBYSHEV] > 0.0;
+}
+
+static void chebyshev(const float *effects, float *x, int len) {
+	float n = fastpowf(50.0, effects[CHEBYSHEV]);
+	// Apply a distant variant of the Chebyshev polynomial of the first kind
+	dsp.chebyshev(x, n, len);
+}
+
+static bool sampleAndHoldActive(const float *effects) {
+	return effects[SAMPLE_AND_HOLD] > 0.0;
+}
+
+static void sampleAndHold(const float *effects, float *x, int len) {
+	// The hold time is in samples of the wave, so scale it when oversampled
+	float frameskip = fastpowf(WAVE_LEN / 2.0, clampf(effects[SAMPLE_AND_HOLD], 0.0, 1.0)) * len / WAVE_LEN;
+	float tmp[WAVE_LEN * EFFECT_OVERSAMPLE_MAX + 1];
+	memcpy(tmp, x, sizeof(float) * len);
+	tmp[len] = tmp[0];
+
+	// Dumb linear interpolation S&H
+	for (int i = 0; i < len; i++) {
+		float index = roundf(i / frameskip) * frameskip;
+		x[i] = linterpf(tmp, clampf(index, 0.0, len - 1));
 	}
+}
 
-	// Quantization
-	if (effects[QUANTIZATION] > 1e-3) {
-		float levels = powf(clampf(effects[QUANTIZATION], 0.0, 1.0), -1.5);
-		for (int i = 0; i < WAVE_LEN; i++) {
-			out[i] = roundf(out[i] * levels) / levels;
-		}
+static bool quantizationActive(const float *effects) {
+	return effects[QUANTIZATION] > 1e-3;
+}
+
+static void quantization(const float *effects, float *x, int len) {
+	float levels = powf(clampf(effects[QUANTIZATION], 0.0, 1.0), -1.5);
+	for (int i = 0; i < len; i++) {
+		x[i] = roundf(x[i] * levels) / levels;
+	}
+}
+
+static bool slewActive(const float *effects) {
+	return effects[SLEW] > 0.0;
+}
+
+/** Slew limiter */
+static void slew(const float *effects, float *x, int len) {
+	// The limit is per sample of the wave, so split it across oversampled samples
+	float slew = powf(0.001, effects[SLEW]) * WAVE_LEN / len;
+
+	float y = x[0];
+	for (int i = 1; i < len; i++) {
+		float dxdt = x[i] - y;
+		float dydt = clampf(dxdt, -slew, slew);
+		y += dydt;
+		x[i] = y;
+	}
+}
+
+static bool filterActive(const float *effects) {
+	return effects[LOWPASS] > 0.0 || effects[HIGHPASS];
+}
+
+/** Brick-wall lowpass / highpass filter */
+// TODO Maybe change this into a more musical filter
+static void filter(const float *effects, float *fft, int len) {
+	float lowpass = 1.0 - effects[LOWPASS];
+	float highpass = effects[HIGHPASS];
+	for (int i = 1; i < WAVE_LEN / 2; i++) {
+		float v = clampf(WAVE_LEN / 2 * lowpass - i, 0.0, 1.0) * clampf(-WAVE_LEN / 2 * highpass + i, 0.0, 1.0);
+		fft[2 * i] *= v;
+		fft[2 * i + 1] *= v;
+	}
+}
+
+
+/** One stage of the effect chain */
+struct EffectStage {
+	/** The range of `effects` which the stage reads */
+	int effect;
+	int effectsLen;
+	bool (*active)(const float *effects);
+	/** Applied to the samples, or to the RFFT of the samples if `spectral` is set.
+	`len` is WAVE_LEN times the chain's oversampling factor for nonlinear stages, and WAVE_LEN otherwise.
+	*/
+	void (*apply)(const float *effects, float *x, int len);
+	/** Spectral stages are linear and only multiply the spectrum, so a run of them can share one transform pair */
+	bool spectral;
+	/** Nonlinear stages create harmonics above the Nyquist frequency, which fold back unless the stage is oversampled */
+	bool nonlinear;
+};
+
+/** Indexed by EffectStageID */
+static const EffectStage effectStages[EFFECT_STAGES_LEN] = {
+	{PRE_GAIN, 1, preGainActive, preGain, false, false},
+	{PHASE_SHIFT, 2, shiftActive, shift, true, false},
+	{COMB, 1, combActive, comb, true, false},
+	{RING, 1, ringActive, ring, false, false},
+	{CHEBYSHEV, 1, chebyshevActive, chebyshev, false, true},
+	{SAMPLE_AND_HOLD, 1, sampleAndHoldActive, sampleAndHold, false, true},
+	{QUANTIZATION, 1, quantizationActive, quantization, false, true},
+	{SLEW, 1, slewActive, slew, false, true},
+	{LOWPASS, 2, filterActive, filter, true, false},
+};
+
+const char *effectStageNames[EFFECT_STAGES_LEN] = {
+	"Pre-Gain",
+	"Phase & Harmonic Shift",
+	"Comb Filter",
+	"Ring Modulation",
+	"Chebyshev Wavefolding",
+	"Sample & Hold",
+	"Quantization",
+	"Slew Limiter",
+	"Lowpass & Highpass Filter",
+};
+
+
+void EffectChain::reset() {
+	memset(this, 0, sizeof(EffectChain));
+	for (int i = 0; i < EFFECT_STAGES_LEN; i++) {
+		stages[i] = i;
+		enabled[i] = true;
+	}
+	len = EFFECT_STAGES_LEN;
+	oversample = 1;
+}
+
+bool EffectChain::valid() const {
+	if (len < 0 || len > EFFECT_CHAIN_LEN)
+		return false;
+	if (!(oversample == 1 || oversample == 2 || oversample == 4 || oversample == 8))
+		return false;
+	for (int i = 0; i < len; i++) {
+		if (stages[i] < 0 || stages[i] >= EFFECT_STAGES_LEN)
+			return false;
+	}
+	return true;
+}
+
+void EffectChain::append(EffectStageID stage) {
+	if (len >= EFFECT_CHAIN_LEN)
+		return;
+	stages[len] = stage;
+	enabled[len] = true;
+	len++;
+}
+
+void EffectChain::remove(int index) {
+	if (index < 0 || index >= len)
+		return;
+	for (int i = index; i < len - 1; i++) {
+		stages[i] = stages[i + 1];
+		enabled[i] = enabled[i + 1];
+	}
+	len--;
+	stages[len] = 0;
+	enabled[len] = false;
+}
+
+void EffectChain::move(int from, int to) {
+	if (from < 0 || from >= len || to < 0 || to >= len)
+		return;
+	int8_t stage = stages[from];
+	bool stageEnabled = enabled[from];
+	int dir = (to > from) ? 1 : -1;
+	for (int i = from; i != to; i += dir) {
+		stages[i] = stages[i + dir];
+		enabled[i] = enabled[i + dir];
 	}
+	stages[to] = stage;
+	enabled[to] = stageEnabled;
+}
 
-	// Slew Limiter
-	if (effects[SLEW] > 0.0) {
-		float slew = powf(0.001, effects[SLEW]);
 
-		float y = out[0];
-		for (int i = 1; i < WAVE_LEN; i++) {
-			float dxdt = out[i] - y;
-			float dydt = clampf(dxdt, -slew, slew);
-			y += dydt;
-			out[i] = y;
+/** An effect chain with disabled stages removed, ready to run.
+Whether a stage is active depends on each wave's effect parameters, so that is still checked when running the plan.
+Runs of active spectral stages share one transform pair, even when inactive temporal stages sit between them.
+*/
+struct EffectPlan {
+	/** The chain which the plan was compiled from */
+	EffectChain chain;
+	int len;
+	const EffectStage *steps[EFFECT_CHAIN_LEN];
+};
+
+/** Converts between a wave and the same wave oversampled by `factor` */
+struct Oversampler {
+	CyclicResampler up;
+	CyclicResampler down;
+
+	Oversampler(int factor) : up(WAVE_LEN, WAVE_LEN * factor), down(WAVE_LEN * factor, WAVE_LEN) {}
+};
+
+/** The transforms are planned once per factor and shared by all threads */
+static const Oversampler *getOversampler(int factor) {
+	static const Oversampler x2(2);
+	static const Oversampler x4(4);
+	static const Oversampler x8(8);
+	switch (factor) {
+		case 2: return &x2;
+		case 4: return &x4;
+		case 8: return &x8;
+		default: return NULL;
+	}
+}
+
+/** Exponential moving average of the seconds spent running the effect chain for one wave */
+static std::atomic<double> effectChainCost(0.0);
+
+double effectChainGetCost() {
+	return effectChainCost;
+}
+
+
+/** Compiling is cheap, but the chain rarely changes between calls, so the last plan is kept per thread */
+static const EffectPlan &compilePlan(const EffectChain &chain) {
+	static thread_local EffectPlan plan = {};
+	if (memcmp(&plan.chain, &chain, sizeof(EffectChain)) == 0)
+		return plan;
+
+	plan.chain = chain;
+	plan.len = 0;
+	for (int i = 0; i < chain.len; i++) {
+		if (chain.enabled[i])
+			plan.steps[plan.len++] = &effectStages[chain.stages[i]];
+	}
+	return plan;
+}
+
+
+/** Output of each active step of the plan for one wave, so an edit only reruns the plan from the first step whose parameters changed */
+struct EffectCache {
+	/** The inputs which the checkpoints were computed from */
+	float samples[WAVE_LEN];
+	float effects[EFFECTS_LEN];
+	EffectChain chain;
+	/** Output of step k, as samples or spectrum depending on the stage */
+	float checkpoints[EFFECT_CHAIN_LEN][WAVE_LEN];
+	bool valid[EFFECT_CHAIN_LEN];
+	uint64_t lastUse;
+};
+
+/** Entries are looked up by address, and checked against the wave's samples, effects and chain before use.
+Only the thread updating a wave touches its entry, so the lock is only held while copying in and out.
+*/
+static std::mutex effectCacheMutex;
+static std::map<const Wave*, EffectCache*> effectCache;
+static size_t effectCacheBudget = 4 << 20;
+static uint64_t effectCacheClock = 0;
+
+/** Evicts the least recently used entries until at most `maxEntries` remain */
+static void effectCacheTrim(size_t maxEntries) {
+	while (effectCache.size() > maxEntries) {
+		std::map<const Wave*, EffectCache*>::iterator oldest = effectCache.begin();
+		for (std::map<const Wave*, EffectCache*>::iterator it = effectCache.begin(); it != effectCache.end(); it++) {
+			if (it->second->lastUse < oldest->second->lastUse)
+				oldest = it;
 		}
+		delete oldest->second;
+		effectCache.erase(oldest);
 	}
+}
 
-	// Brick-wall lowpass / highpass filter
-	// TODO Maybe change this into a more musical filter
-	if (effects[LOWPASS] > 0.0 || effects[HIGHPASS]) {
-		float fft[WAVE_LEN];
-		RFFT(out, fft, WAVE_LEN);
-		float lowpass = 1.0 - effects[LOWPASS];
-		float highpass = effects[HIGHPASS];
-		for (int i = 1; i < WAVE_LEN / 2; i++) {
-			float v = clampf(WAVE_LEN / 2 * lowpass - i, 0.0, 1.0) * clampf(-WAVE_LEN / 2 * highpass + i, 0.0, 1.0);
-			fft[2 * i] *= v;
-			fft[2 * i + 1] *= v;
+void effectCacheSetBudget(size_t bytes) {
+	std::lock_guard<std::mutex> lock(effectCacheMutex);
+	effectCacheBudget = bytes;
+	effectCacheTrim(effectCacheBudget / sizeof(EffectCache));
+}
+
+size_t effectCacheGetBudget() {
+	std::lock_guard<std::mutex> lock(effectCacheMutex);
+	return effectCacheBudget;
+}
+
+size_t effectCacheGetUsage() {
+	std::lock_guard<std::mutex> lock(effectCacheMutex);
+	return effectCache.size() * sizeof(EffectCache);
+}
+
+
+void Wave::updatePost(const EffectChain &chain) {
+	postSpectrumValid = false;
+	PostKey key;
+	key.set(this, chain);
+	uint64_t hash = key.hash();
+	if (postMemoGet(this, key, hash))
+		return;
+
+	std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+	const EffectPlan &plan = compilePlan(key.chain);
+	const Oversampler *oversampler = getOversampler(plan.chain.oversample);
+
+	// The signal is held in one of three buffers, and only converted when a stage needs another one
+	enum Domain {
+		DOMAIN_SAMPLES,
+		DOMAIN_SPECTRUM,
+		DOMAIN_OVERSAMPLED,
+	};
+	Domain domain = DOMAIN_SAMPLES;
+	float out[WAVE_LEN];
+	float fft[WAVE_LEN];
+	float over[WAVE_LEN * EFFECT_OVERSAMPLE_MAX];
+	static thread_local std::vector<float> oversampleBuffer;
+	if (oversampler)
+		oversampleBuffer.resize(oversampler->up.bufferLen());
+
+	// Conversions go through the samples, since that's the one domain the others convert to directly
+	auto convert = [&](Domain to) {
+		if (domain == to)
+			return;
+		if (domain == DOMAIN_SPECTRUM)
+			IRFFT(fft, out, WAVE_LEN);
+		else if (domain == DOMAIN_OVERSAMPLED)
+			oversampler->down.process(over, out, oversampleBuffer.data());
+		if (to == DOMAIN_SPECTRUM)
+			RFFT(out, fft, WAVE_LEN);
+		else if (to == DOMAIN_OVERSAMPLED)
+			oversampler->up.process(out, over, oversampleBuffer.data());
+		domain = to;
+	};
+	// First step to run, after restoring the output of the steps before it from the cache
+	int start = 0;
+	float checkpoints[EFFECT_CHAIN_LEN][WAVE_LEN];
+	bool valid[EFFECT_CHAIN_LEN] = {};
+
+	{
+		std::lock_guard<std::mutex> lock(effectCacheMutex);
+		std::map<const Wave*, EffectCache*>::iterator it = effectCache.find(this);
+		if (it != effectCache.end() && memcmp(it->second->samples, samples, sizeof(samples)) == 0 && memcmp(&it->second->chain, &plan.chain, sizeof(EffectChain)) == 0) {
+			EffectCache *cache = it->second;
+			int dirty = 0;
+			while (dirty < plan.len) {
+				const EffectStage *stage = plan.steps[dirty];
+				if (memcmp(&cache->effects[stage->effect], &effects[stage->effect], sizeof(float) * stage->effectsLen) != 0)
+					break;
+				dirty++;
+			}
+			// Resume after the last active step before the first changed one
+			for (int k = dirty - 1; k >= 0; k--) {
+				if (cache->valid[k]) {
+					start = k + 1;
+					domain = plan.steps[k]->spectral ? DOMAIN_SPECTRUM : DOMAIN_SAMPLES;
+					memcpy(domain == DOMAIN_SPECTRUM ? fft : out, cache->checkpoints[k], sizeof(float) * WAVE_LEN);
+					break;
+				}
+			}
 		}
-		IRFFT(fft, out, WAVE_LEN);
 	}
+	if (start == 0)
+		memcpy(out, samples, sizeof(float) * WAVE_LEN);
+
+	// Only convert at the boundaries between temporal, spectral and oversampled stages.
+	// Skipping the round trips between adjacent spectral stages changes the output by float rounding only, around 1e-7.
+	for (int k = start; k < plan.len; k++) {
+		const EffectStage *stage = plan.steps[k];
+		if (!stage->active(effects))
+			continue;
+		if (stage->spectral)
+			convert(DOMAIN_SPECTRUM);
+		else if (stage->nonlinear && oversampler)
+			convert(DOMAIN_OVERSAMPLED);
+		else
+			convert(DOMAIN_SAMPLES);
+
+		if (domain == DOMAIN_OVERSAMPLED) {
+			stage->apply(effects, over, WAVE_LEN * plan.chain.oversample);
+			// Oversampled output doesn't fit a checkpoint, so an edit after it resumes from an earlier step
+			continue;
+		}
+		float *x = (domain == DOMAIN_SPECTRUM) ? fft : out;
+		stage->apply(effects, x, WAVE_LEN);
+		memcpy(checkpoints[k], x, sizeof(float) * WAVE_LEN);
+		valid[k] = true;
+	}
+	convert(DOMAIN_SAMPLES);
+
+	{
+		std::lock_guard<std::mutex> lock(effectCacheMutex);
+		EffectCache *cache = NULL;
+		std::map<const Wave*, EffectCache*>::iterator it = effectCache.find(this);
+		if (it != effectCache.end()) {
+			cache = it->second;
+		}
+		else {
+			size_t maxEntries = effectCacheBudget / sizeof(EffectCache);
+			if (maxEntries > 0) {
+				effectCacheTrim(maxEntries - 1);
+				cache = new EffectCache();
+				effectCache[this] = cache;
+			}
+		}
 
-	// TODO Consider removing because Normalize does this for you
-	// Post gain
-	if (effects[POST_GAIN]) {
-		float gain = powf(20.0, effects[POST_GAIN]);
-		for (int i = 0; i < WAVE_LEN; i++) {
-			out[i] *= gain;
+		if (cache) {
+			// Checkpoints before `start` are kept, since their inputs didn't change
+			memcpy(cache->samples, samples, sizeof(samples));
+			memcpy(cache->effects, effects, sizeof(effects));
+			cache->chain = plan.chain;
+			for (int k = start; k < EFFECT_CHAIN_LEN; k++) {
+				cache->valid[k] = valid[k];
+				if (valid[k])
+					memcpy(cache->checkpoints[k], checkpoints[k], sizeof(float) * WAVE_LEN);
+			}
+			cache->lastUse = ++effectCacheClock;
 		}
 	}
 
+	// Post gain, cycle, normalize and hard clip are each affine in the sample and its index.
+	// So they are combined into out[i] -> a out[i] + b i + c, and applied in one pass with the clip.
+	// TODO Consider removing post gain because Normalize does this for you
+	float a = effects[POST_GAIN] ? fastpowf(20.0, effects[POST_GAIN]) : 1.0;
+	float b = 0.0;
+	float c = 0.0;
+
 	// Cycle
 	if (cycle) {
-		float start = out[0];
-		float end = out[WAVE_LEN - 1] / (WAVE_LEN - 1) * WAVE_LEN;
-
-		for (int i = 0; i < WAVE_LEN; i++) {
-			out[i] -= (end - start) * (i - WAVE_LEN / 2) / WAVE_LEN;
-		}
+		float start = a * out[0];
+		float end = a * out[WAVE_LEN - 1] / (WAVE_LEN - 1) * WAVE_LEN;
+		float slope = (end - start) / WAVE_LEN;
+		b = -slope;
+		c = slope * (WAVE_LEN / 2);
 	}
 
 	// Normalize
 	if (normalize) {
-		float max = -INFINITY;
-		float min = INFINITY;
-		for (int i = 0; i < WAVE_LEN; i++) {
-			if (out[i] > max) max = out[i];
-			if (out[i] < min) min = out[i];
-		}
-
+		float min, max;
+		dsp.rampMinMax(out, a, b, c, WAVE_LEN, &min, &max);
 		if (max - min >= 1e-6) {
-			for (int i = 0; i < WAVE_LEN; i++) {
-				out[i] = rescalef(out[i], min, max, -1.0, 1.0);
-			}
+			float scale = 2.0 / (max - min);
+			a *= scale;
+			b *= scale;
+			c = (c - min) * scale - 1.0;
 		}
 		else {
-			memset(out, 0, sizeof(float) * WAVE_LEN);
+			a = b = c = 0.0;
 		}
 	}
 
 	// Hard clip :(
-	for (int i = 0; i < WAVE_LEN; i++) {
-		out[i] = clampf(out[i], -1.0, 1.0);
-	}
+	dsp.rampClamp(out, postSamples, a, b, c, -1.0, 1.0, WAVE_LEN);
 
-	// TODO Fix possible race condition with audio thread here
-	// Or not, because the race condition would only just replace samples as they are being read, which just gives a click sound.
-	memcpy(postSamples, out, sizeof(float)*WAVE_LEN);
+	double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	// Waves of a bank are processed in parallel, so the update is retried if another worker changed the cost first
+	double cost = effectChainCost.load();
+	while (!effectChainCost.compare_exchange_weak(cost, cost + 0.1 * (time - cost))) {}
 
-	// Convert wave to spectrum
-	RFFT(postSamples, postSpectrum, WAVE_LEN);
-	// Convert spectrum to harmonics
-	for (int i = 0; i < WAVE_LEN / 2; i++) {
-		postHarmonics[i] = hypotf(postSpectrum[2 * i], postSpectrum[2 * i + 1]) * 2.0;
-	}
+	postMemoSet(this, key, hash);
 }
 
-void Wave::commitSamples() {
-	// Convert wave to spectrum
-	RFFT(samples, spectrum, WAVE_LEN);
-	// Convert spectrum to harmonics
-	for (int i = 0; i < WAVE_LEN / 2; i++) {
-		harmonics[i] = hypotf(spectrum[2 * i], spectrum[2 * i + 1]) * 2.0;
-	}
-	updatePost();
+void Wave::commitSamples(const EffectChain &chain) {
+	spectrumValid = false;
+	updatePost(chain);
 }
 
-void Wave::commitHarmonics() {
+void Wave::commitHarmonics(const EffectChain &chain) {
+	// `harmonics` holds the edited values, so only the spectrum is brought up to date
+	if (!spectrumValid)
+		RFFT(samples, spectrum, WAVE_LEN);
 	// Rescale spectrum by the new norm
+	float oldHarmonics[WAVE_LEN / 2];
+	dsp.norm(spectrum, oldHarmonics, WAVE_LEN / 2);
 	for (int i = 0; i < WAVE_LEN / 2; i++) {
-		float oldHarmonic = hypotf(spectrum[2 * i], spectrum[2 * i + 1]);
+		float oldHarmonic = oldHarmonics[i] / 2.0;
 		float newHarmonic = harmonics[i] / 2.0;
 		if (oldHarmonic > 1.0e-6) {
 			// Preserve old phase but apply new magnitude
@@ -248,54 +702,62 @@ void Wave::commitHarmonics() {
 	}
 	// Convert spectrum to wave
 	IRFFT(spectrum, samples, WAVE_LEN);
-	updatePost();
+	spectrumValid = true;
+	updatePost(chain);
 }
 
-void Wave::clearEffects() {
+void Wave::clearEffects(const EffectChain &chain) {
 	memset(effects, 0, sizeof(float) * EFFECTS_LEN);
 	cycle = false;
 	normalize = false;
-	updatePost();
+	updatePost(chain);
 }
 
-void Wave::bakeEffects() {
+void Wave::bakeEffects(const EffectChain &chain) {
 	memcpy(samples, postSamples, sizeof(float)*WAVE_LEN);
-	clearEffects();
+	spectrumValid = false;
+	clearEffects(chain);
 }
 
-void Wave::randomizeEffects() {
+void Wave::randomizeEffects(const EffectChain &chain) {
 	for (int i = 0; i < EFFECTS_LEN; i++) {
 		effects[i] = randf() > 0.5 ? powf(randf(), 2) : 0.0;
 	}
-	updatePost();
+	updatePost(chain);
 }
 
-void Wave::saveWAV(const char *filename) {
+bool Wave::saveWAV(const char *filename, Dither dither, uint32_t ditherSeed) {
 	SF_INFO info;
 	info.samplerate = SAMPLE_RATE;
 	info.channels = 1;
 	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16 | SF_ENDIAN_LITTLE;
 	SNDFILE *sf = sf_open(filename, SFM_WRITE, &info);
 	if (!sf)
-		return;
+		return false;
 
-	sf_write_float(sf, postSamples, WAVE_LEN);
+	int16_t samples[WAVE_LEN];
+	f32_to_i16(postSamples, samples, WAVE_LEN, dither, ditherSeed);
+	bool ok = sf_write_short(sf, samples, WAVE_LEN) == WAVE_LEN;
 
-	sf_close(sf);
+	return sf_close(sf) == 0 && ok;
 }
 
-void Wave::loadWAV(const char *filename) {
+void Wave::loadWAV(const char *filename, const EffectChain &chain) {
 	clear();
 
-	SF_INFO info;
-	SNDFILE *sf = sf_open(filename, SFM_READ, &info);
-	if (!sf)
+	int length;
+	float *audio = loadAudio(filename, &length);
+	if (!audio)
 		return;
 
-	sf_read_float(sf, samples, WAVE_LEN);
-	commitSamples();
+	// Single cycles exported by other tools can have any length
+	if (length == WAVE_LEN)
+		memcpy(samples, audio, sizeof(float) * WAVE_LEN);
+	else
+		cyclicResample(audio, length, samples, WAVE_LEN);
+	delete[] audio;
 
-	sf_close(sf);
+	commitSamples(chain);
 }
 
 void Wave::clipboardCopy() {
@@ -0,0 +1,119 @@
+#include "WaveEdit.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+/** Threads which sleep between jobs, so starting a job only costs a wakeup instead of a thread creation */
+struct WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable startCv;
+	std::condition_variable doneCv;
+	/** Incremented for each job, so a worker can tell a new job from the one it finished */
+	uint64_t generation = 0;
+	bool quit = false;
+	/** Workers which woke for a job and haven't finished it */
+	int busy = 0;
+
+	const std::function<void(int)> *func = NULL;
+	int count = 0;
+	std::atomic<int> next;
+
+	/** Only one job runs at a time */
+	std::mutex jobMutex;
+
+	WorkerPool() {
+		next = 0;
+		// The calling thread works too
+		int threadsLen = (int) std::thread::hardware_concurrency() - 1;
+		for (int i = 0; i < threadsLen; i++) {
+			threads.push_back(std::thread(&WorkerPool::run, this));
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		startCv.notify_all();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+	}
+
+	void run();
+	void parallelFor(int newCount, const std::function<void(int)> &newFunc);
+};
+
+
+/** Set while the thread is running a job, so nested parallelFor() calls run inline instead of waiting on themselves */
+static thread_local bool inJob = false;
+
+static void work(const std::function<void(int)> &func, int count, std::atomic<int> &next) {
+	inJob = true;
+	int i;
+	while ((i = next++) < count) {
+		func(i);
+	}
+	inJob = false;
+}
+
+
+void WorkerPool::run() {
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		startCv.wait(lock, [&] {return quit || generation != seen;});
+		if (quit)
+			return;
+		seen = generation;
+		// Copy the job while holding the lock. If the job already ended, `next` is past `count` and func isn't called.
+		const std::function<void(int)> *jobFunc = func;
+		int jobCount = count;
+		busy++;
+		lock.unlock();
+
+		if (jobFunc)
+			work(*jobFunc, jobCount, next);
+
+		lock.lock();
+		busy--;
+		if (busy == 0)
+			doneCv.notify_all();
+	}
+}
+
+
+void WorkerPool::parallelFor(int newCount, const std::function<void(int)> &newFunc) {
+	std::lock_guard<std::mutex> jobLock(jobMutex);
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		// A worker which woke late for the previous job might still be looking at its counter
+		doneCv.wait(lock, [&] {return busy == 0;});
+		func = &newFunc;
+		count = newCount;
+		next = 0;
+		generation++;
+	}
+	startCv.notify_all();
+
+	work(newFunc, newCount, next);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCv.wait(lock, [&] {return busy == 0;});
+	func = NULL;
+}
+
+
+void parallelFor(int count, const std::function<void(int)> &func) {
+	static WorkerPool pool;
+	if (inJob || pool.threads.empty() || count <= 1) {
+		for (int i = 0; i < count; i++) {
+			func(i);
+		}
+		return;
+	}
+	pool.parallelFor(count, func);
+}